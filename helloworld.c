@@ -1,9 +1,16 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <unistd.h>
 #include <time.h>
+#include <errno.h>
+#include <stdint.h>
 #include "SDL.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
 
 //Constants for defining the display
 #define BPP      4
@@ -11,10 +18,11 @@
 #define HEIGHT 480
 #define DEPTH   32
 
-//Constants for defining the game area 
-#define TOP    14
+//Constants for defining the game area. The top and right edges
+//depend on the size of the map, so are only known once it's read.
+#define TOP    (game->world.height - 1)
 #define BOTTOM  0
-#define RIGHT  19
+#define RIGHT  (game->world.width - 1)
 #define LEFT    0
 
 //Constants defining game objects
@@ -27,9 +35,27 @@
 #define HORIZONTAL  1
 #define VERTICAL    2
 
+/*
+  Positions and speeds are in subpixels, SUBPIXELS to a pixel, so the
+  physics is all integer math and plays out the same on any compiler
+  and CPU. A position is kept as the whole pixel (see PixelOf) and the
+  fraction of one past it; a move sweeps the whole pixels it reaches
+  and carries what's left over to the next (see SweepBody), so slow
+  speeds and gravity add up exactly rather than being rounded away.
+*/
+#define SUBPIXEL_BITS 8
+#define SUBPIXELS     (1 << SUBPIXEL_BITS)
+#define PIXELS(whole, fraction) ((whole) * SUBPIXELS + (fraction))
+
+#define GRAVITY      PIXELS(1, 154)   //0.05 squares a tick, each tick
+#define FALL_LIMIT   PIXELS(16, 0)    //0.5 squares a tick
+#define JUMP_SPEED   PIXELS(22, 102)  //0.7 squares a tick
+#define RUN_STEP     PIXELS(8, 0)     //0.25 squares a tick
+#define WALK_SPEED   PIXELS(4, 205)   //0.15 squares a tick
+
 enum boolean {FALSE, TRUE};
 
-enum ObjectType {PLAYER, MONSTER, PLATFORM};
+enum ObjectType {NOTHING, PLAYER, MONSTER, PLATFORM};
 
 //Stores a location
 struct point 
@@ -38,27 +64,30 @@ struct point
   int y;
 };
 
-//Stores a direction or speed
+//Stores a direction or speed, in subpixels
 struct vector
 {
-  float x;
-  float y;
+  int x;
+  int y;
 };
 
-//An image associated with a game object
+//An image associated with a game object: the part 'source' of 'image,'
+//which is cell 'cell' of the sprite atlas
 struct icon 
 {
   SDL_Surface *image;
   struct point center;
+  SDL_Rect source;
+  int cell;
 };
 
 //Predefined images for each game object
 struct icon player_icon = 
-  { NULL, {15, 15} };
+  { NULL, {15, 15}, {0, 0, 0, 0}, 0 };
 struct icon block_icon = 
-  { NULL, {15, 15} };
+  { NULL, {15, 15}, {0, 0, 0, 0}, 0 };
 struct icon monster_icon = 
-  { NULL, {15, 15} };
+  { NULL, {15, 15}, {0, 0, 0, 0}, 0 };
 
 /*
   Game objects: these are objects that interact in the game world
@@ -69,632 +98,6456 @@ struct object
 {
   struct point location;
   struct point center;
+  struct point fraction;
   struct vector speed;
   struct icon *icon;
   enum boolean alive;
   enum ObjectType type;
-} player =
-  {
-    {10, 0},
-    {TILE_CENTER_X, TILE_CENTER_Y},
-    {0, 0},
-    &player_icon,
-    TRUE,
-    PLAYER
-  };
+  struct point previous;
+};
 
 /*
-  Some constants that only apply to the player object
-  These signify that the player was stopped by running
-  into a wall and prevent accidental acceleration when
-  keys are released.
+  Objects other than the player are stored in entity stores: each
+  property of the objects is kept in its own dense array, and object
+  'i' is made up of the i'th entry of each. Passes over all of the
+  objects therefore walk straight through memory rather than chasing
+  pointers. Objects are appended at the end and removed by moving the
+  last object into the hole, so both are O(1), but an object's index
+  changes when another is removed.
+
+  A store is a fixed-size pool: all of its memory is allocated when
+  it is set up, and creating or destroying objects afterwards never
+  goes to the system allocator.
 */
-enum boolean blocked_left  = FALSE;
-enum boolean blocked_right = FALSE;
 
-//Objects in the game are generally stored and managed through 
-//in linked lists
-struct object_list
+//Identifies a game object in the grid: its type says which store it
+//lives in (the player lives on its own) and 'id' which object.
+struct entity_ref
+{
+  enum ObjectType type;
+  Uint32 id;
+};
+
+//Links between the objects sharing a square of the grid (see AddToCell)
+struct square_links
+{
+  struct entity_ref next;
+  struct entity_ref prev;
+};
+
+struct entity_store
+{
+  int count;
+  int capacity;
+  struct point *location;
+  struct point *center;
+  struct vector *speed;
+  
+  //The subpixels each object is past its pixel (see SweepBody)
+  struct point *fraction;
+  struct icon **icon;
+  enum boolean *alive;
+  enum ObjectType *type;
+  
+  //Where each object was before the last tick, in the units of PixelOf
+  struct point *previous;
+  
+  //The animation each object is playing (see AnimationFrame), and the
+  //tick it started
+  Uint8 *animation;
+  long *animation_start;
+  
+  //Where each object means to move this tick, and what's in its way
+  //(see PlanMonster)
+  struct point *next_pixel;
+  struct point *next_fraction;
+  Uint8 *next_flags;
+  
+  //Each object's links to the others in its square, by slot rather
+  //than index so they don't move when other objects are removed
+  struct square_links *links;
+  
+  //Handle bookkeeping, see below. Slots from 'slots_touched' on have
+  //never been used.
+  Uint32 *id;
+  Uint32 *slot_index;
+  Uint32 *slot_generation;
+  int free_slot;
+  int slots_touched;
+};
+
+/*
+  Dead monsters fall out of the grid, so the renderer can't find them
+  by square. Those the player kills are listed here (by handle, see
+  below) until they reach the bottom and are destroyed.
+*/
+#define MAX_CORPSES 64
+struct corpse_list
 {
-  struct object object;
-  struct object_list *next_object;
+  int count;
+  Uint32 id[MAX_CORPSES];
 };
 
-struct object_list *g_blocks = NULL;
-struct object_list *g_monsters = NULL;
+//Size of the monster pool; enough to benchmark 100k of them. The block
+//pool is sized to fit the map.
+#define MAX_MONSTERS (1 << 17)
+
+/*
+  Objects are referred to from outside their store by handle rather
+  than by index, since indices change as objects are removed. A handle
+  names a slot, which stays with its object for life, and the
+  generation of the slot when the object was created. Slots are
+  reused, but their generation is bumped each time, so a handle to a
+  destroyed object is recognized as stale instead of finding whatever
+  took its place. Generations start at 1, so 0 is never a handle.
+*/
+#define NO_HANDLE      0
+#define SLOT_BITS      22
+#define SLOT_MASK      ((1 << SLOT_BITS) - 1)
+#define MAX_GENERATION ((1 << (32 - SLOT_BITS)) - 1)
 
 /*
   The purpose of this grid is for collision detection. Each cell
-  in the grid represents a square in the game area and contains a
-  pointer to the game object (if any) that occupies that spot.
+  in the grid represents a square in the game area and refers to
+  the game objects (if any) that occupy that spot.
   This way, there is a simply O(1) method of determining whether any
   particular point on the map is occupied.
+
+  Any number of objects can share a square. The cell holds the first of
+  them, and each object links to the next and previous objects in its
+  square, so objects are added to and taken out of squares in O(1)
+  without allocating anything, however many pile up in one place.
+
+  Maps can be far larger than the screen, so the grid is cut into
+  square chunks, and a chunk is only allocated once something is put
+  in it. Memory therefore follows the filled part of the map rather
+  than its bounding box; the directory of chunks costs one pointer
+  per CHUNK_SIZE x CHUNK_SIZE squares.
 */
-struct object *grid[RIGHT+1][TOP+1] =
-  { {NULL,    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
-    {NULL,    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
-    {NULL,    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
-    {NULL,    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
-    {NULL,    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
-    {NULL,    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
-    {NULL,    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
-    {NULL,    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
-    {NULL,    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
-    {NULL,    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
-    {&player, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
-    {NULL,    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
-    {NULL,    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
-    {NULL,    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
-    {NULL,    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
-    {NULL,    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
-    {NULL,    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
-    {NULL,    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
-    {NULL,    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
-    {NULL,    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL} };
-
-//Some general collision detection functions. They do not
-//detect what the colliding object is, only it's location.
-enum boolean onFloor(struct object *obj)
-{ return (obj->location.y == BOTTOM || (grid[obj->location.x][obj->location.y-1] != NULL)); }
-
-enum boolean atCeiling(struct object *obj)
-{ return (obj->location.y == TOP || (grid[obj->location.x][obj->location.y+1] != NULL)); }
-
-enum boolean atRightWall(struct object *obj)
-{ return (obj->location.x == RIGHT || (grid[obj->location.x+1][obj->location.y] != NULL)); }
-
-enum boolean atLeftWall(struct object *obj)
-{ return (obj->location.x == LEFT || (grid[obj->location.x-1][obj->location.y] != NULL)); }
-
-enum boolean atCorner(struct object *obj, struct vector direction)
-{
-  int x = (int)(direction.x / fabs(direction.x));
-  int y = (int)(direction.y / fabs(direction.y));
-  return (grid[obj->location.x+x][obj->location.y+y] != NULL);
-}
-
-
-//Stops an object and centers it in its square.
-void StopObject(struct object *obj, int direction)
-{
-  switch (direction)
-    {
-    case HORIZONTAL:
-      obj->speed.x = 0;
-      obj->center.x = TILE_CENTER_X;
-      break;
-    case VERTICAL:
-      obj->speed.y = 0;
-      obj->center.y = TILE_CENTER_Y;
-      break;
-    case HORIZONTAL|VERTICAL:
-      obj->speed.x = 0;
-      obj->center.x = TILE_CENTER_X;
-      obj->speed.y = 0;
-      obj->center.y = TILE_CENTER_Y;
-      break;
-    }
-}
+#define CHUNK_BITS 4
+#define CHUNK_SIZE (1 << CHUNK_BITS)
+#define CHUNK_MASK (CHUNK_SIZE - 1)
+
+struct chunk
+{
+  struct entity_ref cells[CHUNK_SIZE][CHUNK_SIZE];
+};
+
+//A chunk's part of the solidity map (see Solid): a bit per square, a
+//row of the chunk to a word
+#if CHUNK_SIZE > 16
+#error "rows of a solid_block are 16 bits"
+#endif
+struct solid_block
+{
+  Uint16 rows[CHUNK_SIZE];
+};
+
+/*
+  The platforms of a chunk aren't made into objects until something
+  comes near them (see StreamAround). Until then the chunk's state is
+  CHUNK_UNLOADED; chunks with no platforms at all are CHUNK_EMPTY and
+  never need loading. They're made from the solidity map, so the map
+  file is only read when the world is loaded.
+*/
+enum ChunkState {CHUNK_EMPTY, CHUNK_UNLOADED, CHUNK_LOADED};
+
+struct world
+{
+  int width;
+  int height;
+  int chunks_x;
+  int chunks_y;
+  struct chunk **chunks;
+  Uint8 *chunk_state;
+  int block_count;
+  
+  //One bit per square, set where there's a platform (see Solid): the
+  //blocks of the chunks with platforms, and each chunk's block
+  struct solid_block *solid;
+  int solid_count;
+  int solid_capacity;
+  Uint32 *solid_index;
+  
+  //Bumped whenever platforms are added, so cached drawings of them can
+  //tell they're out of date
+  int revision;
+};
+
+//Counts of memory and pool traffic, so that the steady state can be
+//checked for heap use.
+struct alloc_counters
+{
+  long heap_allocs;
+  long heap_frees;
+  long created;
+  long destroyed;
+  long exhausted;
+  long no_room;
+  long stale_refs;
+};
 
 /*
-  Moves and object in 'direction,' updating the grid as it does so
-  to reflect the move. Objects move within their squares before they
-  move between them.
+  Everything about a game that changes as it's played is kept in a
+  struct game, so one process can run any number of games (see
+  Batches). 'game' is the one the calling thread is working on; it's
+  the interactive game unless the thread has been set to another.
+  The parts that belong to later sections are kept by pointer and
+  allocated with the game (see InitGame).
+
+  What's left global is shared by every game, and is safe to share:
+  the settings from the command line (map_file, worker_count,
+  trace_file and the like), set before any game starts and only read
+  after; the images and sounds, loaded once and only read; the thread
+  pool, which takes jobs from one thread at a time (see
+  ParallelBatches); and the window's renderer, input, snapshots and
+  frame timing, which only the interactive game (or the one --render
+  draws) ever uses.
 */
-void MoveObject(struct object *object, struct vector *direction)
+struct game
 {
-  int new_center_x = object->center.x + round(direction->x * TILE_WIDTH);
-  int new_center_y = object->center.y + round(direction->y * TILE_HEIGHT);
+  struct object player;
+  
+  //The player was stopped by running into a wall. Keeps it from
+  //speeding up by accident when keys are released.
+  enum boolean blocked_left;
+  enum boolean blocked_right;
+  
+  //The player's links to the others in its square
+  struct square_links player_links;
+  
+  struct entity_store blocks;
+  struct entity_store monsters;
+  int max_monsters;
+  struct corpse_list corpses;
+  struct world world;
+  
+  //Ticks the world has been updated for
+  long animation_clock;
+  
+  //State of the game's random numbers (see Random)
+  unsigned int seed;
+  
+  //Headless games drop 'spawn_rate' more monsters a tick, and keep
+  //the part of one they have left to spawn, both in SPAWN_SHARES
+  enum boolean headless;
+  int spawn_rate;
+  int spawn_credit;
+  
+  //The tick headless runs next try each top corner (left, then right)
+  //after finding it blocked, and how long they waited (see RetryAfter)
+  long corner_due[2];
+  int corner_wait[2];
+  
+  struct alloc_counters counters;
   
-  grid[object->location.x][object->location.y] = NULL;
+  //Icons drawn of the game, and how long drawing them took, timed a
+  //list at a time (see DrawList)
+  long blits;
+  double blit_seconds;
   
-  if (new_center_x < 0)
+  struct timer_wheel *wheel;
+  struct spawner_list *spawners;
+  struct flow_field *flow;
+  struct rewind_buffer *rewind;
+  struct profiler *profiler;
+  struct replay *replay;
+};
+
+//The game played in the window (and by the other runs of one game)
+struct game interactive_game;
+__thread struct game *game = &interactive_game;
+
+//Returns a random number from 0 to RAND_MAX, from the game's own
+//sequence so that games don't disturb one another's.
+int Random()
+{ return rand_r(&game->seed); }
+
+//Every trip the game makes to the system allocator goes through here.
+void *Allocate(size_t size)
+{
+  void *memory = malloc(size);
+  if (memory == NULL)
     {
-      object->center.x = new_center_x + TILE_WIDTH;
-      object->location.x--;
+      fprintf(stderr, "Out of memory allocating %lu bytes\n", (unsigned long)size);
+      exit(1);
     }
-  else if (new_center_x > TILE_WIDTH)
+  game->counters.heap_allocs++;
+  return memory;
+}
+
+void Release(void *memory)
+{
+  if (memory != NULL)
     {
-      object->center.x = new_center_x - TILE_WIDTH;
-      object->location.x++;
+      free(memory);
+      game->counters.heap_frees++;
     }
-  else
-    { object->center.x = new_center_x; }
+}
+
+//Allocates the pool behind 'store,' with room for 'capacity' objects.
+void InitStore(struct entity_store *store, int capacity)
+{
+  if (capacity > SLOT_MASK + 1)
+    { capacity = SLOT_MASK + 1; }
+  else if (capacity < 1)
+    { capacity = 1; }
+  
+  store->count = 0;
+  store->capacity = capacity;
+  store->location = Allocate(capacity * sizeof(struct point));
+  store->center = Allocate(capacity * sizeof(struct point));
+  store->speed = Allocate(capacity * sizeof(struct vector));
+  store->fraction = Allocate(capacity * sizeof(struct point));
+  store->icon = Allocate(capacity * sizeof(struct icon *));
+  store->alive = Allocate(capacity * sizeof(enum boolean));
+  store->type = Allocate(capacity * sizeof(enum ObjectType));
+  store->previous = Allocate(capacity * sizeof(struct point));
+  store->animation = Allocate(capacity * sizeof(Uint8));
+  store->animation_start = Allocate(capacity * sizeof(long));
+  store->next_pixel = Allocate(capacity * sizeof(struct point));
+  store->next_fraction = Allocate(capacity * sizeof(struct point));
+  store->next_flags = Allocate(capacity * sizeof(Uint8));
+  store->links = Allocate(capacity * sizeof(struct square_links));
+  store->id = Allocate(capacity * sizeof(Uint32));
+  store->slot_index = Allocate(capacity * sizeof(Uint32));
+  store->slot_generation = Allocate(capacity * sizeof(Uint32));
   
-  if (new_center_y < 0)
+  //Free slots are chained through 'slot_index'
+  for(int slot = 0; slot < capacity; slot++)
     {
-      object->center.y = new_center_y + TILE_HEIGHT;
-      object->location.y--;
+      store->slot_generation[slot] = 1;
+      store->slot_index[slot] = slot + 1;
     }
-  else if (new_center_y > TILE_HEIGHT)
+  store->slot_index[capacity - 1] = -1;
+  store->free_slot = 0;
+  store->slots_touched = 0;
+}
+
+//Gives the pool behind 'store' back to the system.
+void FreeStore(struct entity_store *store)
+{
+  Release(store->location);
+  Release(store->center);
+  Release(store->speed);
+  Release(store->fraction);
+  Release(store->icon);
+  Release(store->alive);
+  Release(store->type);
+  Release(store->previous);
+  Release(store->animation);
+  Release(store->animation_start);
+  Release(store->next_pixel);
+  Release(store->next_fraction);
+  Release(store->next_flags);
+  Release(store->links);
+  Release(store->id);
+  Release(store->slot_index);
+  Release(store->slot_generation);
+  memset(store, 0, sizeof(struct entity_store));
+}
+
+//Returns the index of the object 'id' refers to, or -1 if it is stale.
+int LookupObject(struct entity_store *store, Uint32 id)
+{
+  Uint32 slot = id & SLOT_MASK;
+  if (id == NO_HANDLE || slot >= (Uint32)store->capacity ||
+      store->slot_generation[slot] != id >> SLOT_BITS)
+    { return -1; }
+  return store->slot_index[slot];
+}
+
+struct entity_store *StoreOf(enum ObjectType type)
+{
+  switch (type)
     {
-      object->center.y = new_center_y - TILE_HEIGHT;
-      object->location.y++;
+    case MONSTER:
+      return &game->monsters;
+    case PLATFORM:
+      return &game->blocks;
+    default:
+      return NULL;
     }
-  else
-    { object->center.y = new_center_y; }
-  
-  grid[object->location.x][object->location.y] = object;
 }
 
-/********************************************************************\
-                              Graphics
-\********************************************************************/
 
-//Sets the pixel signified by 'x' and 'y' to 'color.'
-void DrawPixel(SDL_Surface *screen, int x, int y, Uint32 color)
+//Stands in for every square of an unallocated chunk. Never written.
+const struct entity_ref empty_cell = {NOTHING, NO_HANDLE};
+
+int ChunkIndex(int x, int y)
+{ return (y >> CHUNK_BITS) * game->world.chunks_x + (x >> CHUNK_BITS); }
+
+//Returns what is in a square. Never allocates.
+struct entity_ref GetCell(int x, int y)
 {
-  Uint32 *bufp;
-    
-  bufp = (Uint32 *)screen->pixels + y*screen->pitch/4 + x;
-  *bufp = color;
+  struct chunk *chunk = game->world.chunks[ChunkIndex(x, y)];
+  return (chunk == NULL) ? empty_cell : chunk->cells[x & CHUNK_MASK][y & CHUNK_MASK];
 }
 
-//Sets the entire screen to 'color.'
-void ClearScreen(SDL_Surface *screen, Uint32 color)
+/*
+  The solidity map has a bit for each square of the game area, set
+  where the map has a platform. It's filled in for the whole map when
+  the map is loaded, so unlike the grid it doesn't wait for chunks to
+  be read. Like the grid it's kept a chunk at a time: each chunk with
+  platforms has a solid_block, square x of a row being bit
+  x % CHUNK_SIZE, and the chunks without any all share block 0, which
+  is clear. So it takes memory for the filled part of the map, and an
+  index a chunk, and a run of squares is a shift and a mask a chunk.
+*/
+
+//Returns the bits of row 'y' of the chunk holding square 'x,' the
+//chunk's leftmost square in bit 0.
+Uint32 SolidRow(int x, int y)
+{ return game->world.solid[game->world.solid_index[ChunkIndex(x, y)]].rows[y & CHUNK_MASK]; }
+
+enum boolean Solid(int x, int y)
+{ return (SolidRow(x, y) >> (x & CHUNK_MASK)) & 1; }
+
+//Returns the bits of the 'count' squares (at most 64) of row 'y' from
+//square 'x' on, square 'x' in bit 0. They must all be in the game area.
+Uint64 SolidRun(int x, int count, int y)
 {
-  Uint32 *bufp;
-  bufp = (Uint32 *)screen->pixels;
-  
-  for(int i = 0; i < screen->h * screen->w; i++ ) 
+  Uint64 bits = 0;
+  for(int done = 0; done < count; done += CHUNK_SIZE - ((x + done) & CHUNK_MASK))
+    { bits |= (Uint64)(SolidRow(x + done, y) >> ((x + done) & CHUNK_MASK)) << done; }
+  return (count == 64) ? bits : bits & (((Uint64)1 << count) - 1);
+}
+
+//Sets the bit of square ('x', 'y'), giving its chunk a block of its
+//own if it doesn't have one yet.
+void SetSolid(int x, int y)
+{
+  Uint32 *index = &game->world.solid_index[ChunkIndex(x, y)];
+  if (*index == 0)
     {
-      *bufp = color;
-      bufp++;
+      if (game->world.solid_count == game->world.solid_capacity)
+	{
+	  game->world.solid_capacity *= 2;
+	  struct solid_block *grown = Allocate(game->world.solid_capacity * sizeof(struct solid_block));
+	  memcpy(grown, game->world.solid, game->world.solid_count * sizeof(struct solid_block));
+	  Release(game->world.solid);
+	  game->world.solid = grown;
+	}
+      *index = game->world.solid_count++;
+      memset(&game->world.solid[*index], 0, sizeof(struct solid_block));
     }
+  game->world.solid[*index].rows[y & CHUNK_MASK] |= 1 << (x & CHUNK_MASK);
 }
 
-//Blits an icon to the screen location set by 'x' and 'y,' 
-//offset by the icon center.
-void DrawIcon(SDL_Surface *screen, struct icon *icon, int x, int y)
+//Returns where the links of the object 'ref' are kept.
+struct square_links *LinksOf(struct entity_ref ref)
 {
-  SDL_Rect dest;
-  dest.x = x - icon->center.x;
-  dest.y = y - icon->center.y;
-  dest.w = icon->image->w;
-  dest.h = icon->image->h;
-  
-  if(icon->image == NULL)
-    { printf("Bad Image\n"); }
-  else 
-    { SDL_BlitSurface(icon->image, NULL, screen, &dest);}
+  if (ref.type == PLAYER)
+    { return &game->player_links; }
+  return &StoreOf(ref.type)->links[ref.id & SLOT_MASK];
 }
 
-//Blits object icon to the objects square and offset "center"
-//in the game area.
-void DrawObject(SDL_Surface *screen, struct object *obj)
+//Returns the object after 'ref' in its square.
+struct entity_ref NextInCell(struct entity_ref ref)
+{ return LinksOf(ref)->next; }
+
+//Puts 'ref' in a square along with whatever is there, allocating the
+//square's chunk if it is the first thing to go there.
+void AddToCell(int x, int y, struct entity_ref ref)
 {
-  SDL_Rect dest;
-  dest.x = obj->location.x * TILE_WIDTH;
-  dest.y = (14 - obj->location.y) * TILE_HEIGHT;
-  dest.w = TILE_WIDTH - 1;
-  dest.h = TILE_HEIGHT - 1;
+  struct chunk **chunk = &game->world.chunks[ChunkIndex(x, y)];
+  if (*chunk == NULL)
+    {
+      *chunk = Allocate(sizeof(struct chunk));
+      memset(*chunk, 0, sizeof(struct chunk));
+    }
+  struct entity_ref *first = &(*chunk)->cells[x & CHUNK_MASK][y & CHUNK_MASK];
+  struct square_links *links = LinksOf(ref);
+  links->prev = empty_cell;
+  links->next = *first;
+  if (first->type != NOTHING)
+    { LinksOf(*first)->prev = ref; }
+  *first = ref;
+}
 
-  DrawIcon(screen, obj->icon, dest.x + obj->center.x,
-	   dest.y + (TILE_HEIGHT - (1 + obj->center.y)));
+//Puts 'ref' in the square of 'before,' just after it.
+void InsertAfter(struct entity_ref before, struct entity_ref ref)
+{
+  struct square_links *links = LinksOf(ref);
+  links->prev = before;
+  links->next = LinksOf(before)->next;
+  if (links->next.type != NOTHING)
+    { LinksOf(links->next)->prev = ref; }
+  LinksOf(before)->next = ref;
 }
 
-//Draws the player to the screen
-void DrawTortoise(SDL_Surface *screen)
+//Takes 'ref' out of a square. Does nothing if it isn't there.
+void RemoveFromCell(int x, int y, struct entity_ref ref)
 {
-  DrawObject(screen, &player);
-  
-  Uint32 color = SDL_MapRGB(screen->format, 255,255,255);
+  struct chunk *chunk = game->world.chunks[ChunkIndex(x, y)];
+  if (chunk == NULL)
+    { return; }
+  struct entity_ref *first = &chunk->cells[x & CHUNK_MASK][y & CHUNK_MASK];
+  struct square_links *links = LinksOf(ref);
+  if (links->prev.type != NOTHING)
+    { LinksOf(links->prev)->next = links->next; }
+  else if (first->type == ref.type && first->id == ref.id)
+    { *first = links->next; }
+  else
+    { return; }
+  if (links->next.type != NOTHING)
+    { LinksOf(links->next)->prev = links->prev; }
+  links->next = empty_cell;
+  links->prev = empty_cell;
+}
 
-  int left = player.location.x * TILE_WIDTH;
-  int right = left + 31;
-  int top = (14 - player.location.y) * TILE_HEIGHT;
-  int bottom = top + 31;
+//Returns the first object of 'type' in a square, or empty_cell if
+//there isn't one.
+struct entity_ref FindInCell(int x, int y, enum ObjectType type)
+{
+  struct entity_ref ref;
+  for(ref = GetCell(x, y); ref.type != NOTHING && ref.type != type; ref = NextInCell(ref))
+    { }
+  return ref;
+}
 
-  DrawPixel(screen, left, top, color);
-  DrawPixel(screen, left, bottom, color);
-  DrawPixel(screen, right, top, color);
-  DrawPixel(screen, right, bottom, color);
+//Copies up to 'max' of the objects in a square into 'found.' Returns
+//how many there are in all.
+int CellOccupants(int x, int y, struct entity_ref *found, int max)
+{
+  int count = 0;
+  for(struct entity_ref ref = GetCell(x, y); ref.type != NOTHING; ref = NextInCell(ref))
+    {
+      if (count < max)
+	{ found[count] = ref; }
+      count++;
+    }
+  return count;
 }
 
-/*********************************************************\
-                         Environment
-\*********************************************************/
+void StreamAround(struct point at);
 
-//Returns a pointer to the last object in the list
-struct object_list *FindEndOfObjects(struct object_list *objects)
+//Returns the position of an object in pixels, right and up from the
+//bottom-left corner of the game area.
+struct point PixelOf(struct point location, struct point center)
 {
-  return (objects->next_object == NULL) ? objects : FindEndOfObjects(objects->next_object);
+  struct point pixel = {location.x * TILE_WIDTH + center.x, location.y * TILE_HEIGHT + center.y};
+  return pixel;
 }
 
-//Inserts a new object to the end of the list.
-//Also adds a reference in grid to new object.
-void CreateObject(struct object_list **objects, struct point location, struct point center, struct vector speed, struct icon *icon, enum ObjectType object_type)
+//Returns the point 'alpha' of the way from 'from' to 'to.'
+struct point Interpolate(struct point from, struct point to, float alpha)
 {
-  struct object_list *new_object;
-  new_object = malloc(sizeof(struct object_list));
-  
-  new_object->object.location = location;
-  new_object->object.center = center;
-  new_object->object.speed = speed;
-  new_object->object.icon = icon;
-  new_object->object.alive = TRUE;
-  new_object->object.type = object_type;
-  new_object->next_object = NULL;  
+  struct point between = {from.x + lroundf((to.x - from.x) * alpha),
+			  from.y + lroundf((to.y - from.y) * alpha)};
+  return between;
+}
+
+//Returns the square holding 'pixel' (see PixelOf) and where in it.
+void SquareOf(struct point pixel, struct point *location, struct point *center)
+{
+  location->x = pixel.x / TILE_WIDTH;
+  location->y = pixel.y / TILE_HEIGHT;
+  center->x = pixel.x % TILE_WIDTH;
+  center->y = pixel.y % TILE_HEIGHT;
+}
+
+//Moves the object 'self' from 'location' to 'to,' updating the grid to
+//reflect the move.
+void ChangeSquare(struct point *location, struct point to, struct entity_ref self)
+{
+  int old_chunk = ChunkIndex(location->x, location->y);
+  RemoveFromCell(location->x, location->y, self);
+  *location = to;
   
-  grid[location.x][location.y] = &(new_object->object);
+  //Make sure the platforms around a new chunk are there to be hit
+  if (ChunkIndex(location->x, location->y) != old_chunk)
+    { StreamAround(*location); }
   
-  if (*objects == NULL)
+  AddToCell(location->x, location->y, self);
+}
+
+/*
+  Collision detection. Platforms fill their squares; the player and the
+  monsters are boxes a little smaller than a square, centered on their
+  pixel positions, so they can stand anywhere rather than only in the
+  middle of a square. A move is swept along its whole path, x first and
+  then y, and stops at the first thing in the way, so nothing can pass
+  through anything else however fast it's going.
+
+  The grid is the broad phase: only the objects in the squares the
+  sweep passes through (and one square around them, for bodies that
+  hang over from next door) are looked at. Bodies that already overlap
+  when a move starts don't block each other, so piles can come apart.
+*/
+#define BODY_HALF 15
+
+//The room a body centered in its square has on either side
+#define NEAR_WALL (TILE_WIDTH - 2 * BODY_HALF)
+
+//A rectangle in the units of PixelOf. 'right' and 'top' are just outside it.
+struct box
+{
+  int left;
+  int right;
+  int bottom;
+  int top;
+};
+
+//A block of squares of the game area
+struct view
+{
+  int left;
+  int right;
+  int bottom;
+  int top;
+};
+
+//Returns the squares holding objects that could overlap 'box': those
+//it covers, and one more all round for bodies hanging over from there.
+struct view SquaresNear(struct box box)
+{
+  struct view view = {box.left / TILE_WIDTH - 1, (box.right - 1) / TILE_WIDTH + 1,
+		      box.bottom / TILE_HEIGHT - 1, (box.top - 1) / TILE_HEIGHT + 1};
+  if (view.left < LEFT)
+    { view.left = LEFT; }
+  if (view.right > RIGHT)
+    { view.right = RIGHT; }
+  if (view.bottom < BOTTOM)
+    { view.bottom = BOTTOM; }
+  if (view.top > TOP)
+    { view.top = TOP; }
+  return view;
+}
+
+/*
+  Walks the objects in a block of squares: a row at a time from the
+  bottom, each row from the left, and each square's objects in the
+  order NextInCell gives them. Like GetCell it never allocates, and
+  squares in chunks that were never filled cost only a look.
+*/
+struct view_walk
+{
+  struct view view;
+  int x;
+  int y;
+  struct entity_ref ref;
+};
+
+//Returns the next object of 'walk,' or empty_cell once there are no
+//more.
+static inline struct entity_ref NextInView(struct view_walk *walk)
+{
+  if (walk->ref.type != NOTHING)
+    { walk->ref = NextInCell(walk->ref); }
+  while (walk->ref.type == NOTHING)
     {
-      *objects = new_object;
+      if (walk->x < walk->view.right)
+	{ walk->x++; }
+      else if (walk->y < walk->view.top)
+	{
+	  walk->x = walk->view.left;
+	  walk->y++;
+	}
+      else
+	{ return empty_cell; }
+      walk->ref = GetCell(walk->x, walk->y);
     }
-  else
-    { 
-      struct object_list *last_object = FindEndOfObjects(*objects);
-      last_object->next_object = new_object;
+  return walk->ref;
+}
+
+//Starts 'walk' on the squares of 'view' and returns its first object,
+//or empty_cell if there's nothing there.
+static inline struct entity_ref FirstInView(struct view_walk *walk, struct view view)
+{
+  walk->view = view;
+  walk->ref = empty_cell;
+  if (view.left > view.right || view.bottom > view.top)
+    {
+      walk->x = view.right;
+      walk->y = view.top;
+      return empty_cell;
     }
+  walk->x = view.left - 1;
+  walk->y = view.bottom;
+  return NextInView(walk);
 }
 
-//Removes object from list, but not from the grid.
-//This is to accommodate objects that shouldn't be collision
-//detected, but still need to be printed. (only dead objects)
-void DestroyObject(struct object_list **object)
+//Returns the box of a body at 'pixel.'
+struct box BodyBox(struct point pixel)
 {
-  struct object_list *tail = (**object).next_object;
-  free(*object);
-  *object = tail;
+  struct box box = {pixel.x - BODY_HALF, pixel.x + BODY_HALF,
+		    pixel.y - BODY_HALF, pixel.y + BODY_HALF};
+  return box;
 }
 
-/*********************************************************\
-                           Main Loop 
-\*********************************************************/
+//Returns the box of the object 'ref.'
+struct box BoxOf(struct entity_ref ref)
+{
+  if (ref.type == PLAYER)
+    { return BodyBox(PixelOf(game->player.location, game->player.center)); }
+  
+  struct entity_store *store = StoreOf(ref.type);
+  int i = LookupObject(store, ref.id);
+  if (ref.type == PLATFORM)
+    {
+      struct point at = store->location[i];
+      struct box box = {at.x * TILE_WIDTH, (at.x + 1) * TILE_WIDTH,
+			at.y * TILE_HEIGHT, (at.y + 1) * TILE_HEIGHT};
+      return box;
+    }
+  return BodyBox(PixelOf(store->location[i], store->center[i]));
+}
 
-void initialize()
+//What a sweep ran into: how far it got (in pixels, signed like the
+//move), whether it was stopped, and by what (empty_cell for the edge
+//of the game area). 'crowded' is set if other bodies were near.
+struct contact
 {
-  //Initialize display
-  if ( SDL_Init(SDL_INIT_AUDIO|SDL_INIT_VIDEO) < 0 )
+  int distance;
+  enum boolean blocked;
+  struct entity_ref with;
+  enum boolean crowded;
+};
+
+/*
+  Returns how far the leading edge 'edge' of 'box' can go along 'axis'
+  (forward if 'forward,' else back) before it meets a platform, or -1
+  if it can go 'reach' pixels without meeting one. The platform's
+  square is put in 'square.' Platforms the box already overlaps don't
+  count. Reads only the solidity map: a run of bits along each row
+  level with the box for HORIZONTAL, or the bits under or over it a
+  row at a time for VERTICAL (bodies are never more than 64 squares
+  wide).
+*/
+int SolidGap(struct box box, int axis, int forward, int edge, int reach, struct point *square)
+{
+  //The squares across the path, and how far the path goes along it
+  int low, high, size, last;
+  if (axis == HORIZONTAL)
     {
-      fprintf(stderr, "Unable to init SDL: %s\n", SDL_GetError());
-      exit(1);
+      low = box.bottom / TILE_HEIGHT;
+      high = (box.top - 1) / TILE_HEIGHT;
+      size = TILE_WIDTH;
+      last = RIGHT;
     }
-  atexit(SDL_Quit);
-  
-  //Preload icon images
-  player.icon->image = SDL_LoadBMP("gingerbread.bmp");
-  if ( player.icon->image == NULL )
+  else
     {
-      fprintf(stderr, "Couldn't load %s: %s\n", "gingerbread.bmp", SDL_GetError());
-      return;
+      low = box.left / TILE_WIDTH;
+      high = (box.right - 1) / TILE_WIDTH;
+      size = TILE_HEIGHT;
+      last = TOP;
     }
-  block_icon.image = SDL_LoadBMP("block.bmp");
-  if ( block_icon.image == NULL )
+  if (low < 0)
+    { low = 0; }
+  if (high > (axis == HORIZONTAL ? TOP : RIGHT))
+    { high = (axis == HORIZONTAL) ? TOP : RIGHT; }
+  
+  //The nearest and furthest squares along the path
+  int near, far;
+  if (forward)
     {
-      fprintf(stderr, "Couldn't load %s: %s\n", "block.bmp", SDL_GetError());
-      return;
+      near = (edge + size - 1) / size;
+      far = (edge + reach) / size;
+      if (far > last)
+	{ far = last; }
     }
-  monster_icon.image = SDL_LoadBMP("monster.bmp");
-  if ( block_icon.image == NULL )
+  else
     {
-      fprintf(stderr, "Couldn't load %s: %s\n", "monster.bmp", SDL_GetError());
-      return;
+      near = edge / size - 1;
+      far = (edge - reach + size - 1) / size - 1;
+      if (far < 0)
+	{ far = 0; }
     }
+  if (low > high || (forward ? near > far : near < far))
+    { return -1; }
   
-  //Generate platform objects and place them according to the
-  //schema established in the 'map.txt' file.
-  struct point center = {TILE_CENTER_X, TILE_CENTER_Y};
-  struct vector speed = {0, 0};
-  FILE *fp = fopen("map.txt","r");
-  for(int y = TOP; y > BOTTOM; y--)
+  int found = -1;
+  if (axis == HORIZONTAL)
     {
-      for(int x = LEFT; x <= RIGHT + 1; x++)
+      //Each row level with the box, nearest bit first
+      for(int y = low; y <= high; y++)
 	{
-	  if (getc(fp) == '*')
+	  int x = -1;
+	  if (forward)
+	    for(int start = near; x < 0 && start <= far; start += 64)
+	      {
+		int count = (far - start + 1 < 64) ? far - start + 1 : 64;
+		Uint64 bits = SolidRun(start, count, y);
+		if (bits != 0)
+		  { x = start + __builtin_ctzll(bits); }
+	      }
+	  else
+	    for(int end = near; x < 0 && end >= far; end -= 64)
+	      {
+		int start = (end - 63 > far) ? end - 63 : far;
+		Uint64 bits = SolidRun(start, end - start + 1, y);
+		if (bits != 0)
+		  { x = start + 63 - __builtin_clzll(bits); }
+	      }
+	  if (x >= 0 && (found < 0 || (forward ? x < found : x > found)))
 	    {
-	      struct point location;
-	      location.x = x;
-	      location.y = y;
-	      CreateObject(&g_blocks, location, center, speed, &block_icon, PLATFORM );
+	      found = x;
+	      square->x = x;
+	      square->y = y;
 	    }
 	}
     }
-  
-  //Create initial monsters
-  struct point location = {LEFT,TOP};
-  CreateObject(&g_monsters, location, center, speed, &monster_icon, MONSTER);
-  location.x = RIGHT;
-  CreateObject(&g_monsters, location, center, speed, &monster_icon, MONSTER);
-}
-
-/*
-  UpdateMonsters simulates the behavior of all of the game's "monster"
-  objects. The "physics" and "AI" associated with them happen here.
- */
-void UpdateMonsters()
-{
-  for(struct object_list *monsterp = g_monsters; monsterp != NULL; monsterp = monsterp->next_object)
+  else
     {
-      //If monster happens to be dead, merely cause it to fall some.
-      if(!monsterp->object.alive)
-	{
-	  if(monsterp->object.location.y > 0)
-	    { monsterp->object.location.y--; }
-	  break;
-	}
-      
-      //Kill monsters that reach the end of their paths (bottom two corners),
-      //More are constantly spawned anyway.
-      if(monsterp->object.location.y == BOTTOM &&
-	 (monsterp->object.location.x == RIGHT ||
-	  monsterp->object.location.x == LEFT))
+      //The squares under or over the box, a row at a time
+      for(int y = near; found < 0 && (forward ? y <= far : y >= far); y += forward ? 1 : -1)
 	{
-	  monsterp->object.alive = FALSE;
-	  break;
-	}
-
-      //When a monsters hits an obstacle, have it reverse direction. (Also, start
-      //moving if it's sitting next to a wall.
-      if(monsterp->object.speed.x >= 0 && atRightWall(&(monsterp->object)))
-	{ monsterp->object.speed.x = -0.15; }
-      else if(monsterp->object.speed.x <= 0 && atLeftWall(&(monsterp->object)))
-	{ monsterp->object.speed.x = 0.15; }
-       
-      //Make sure monsters don't go through ceilings
-      if(monsterp->object.speed.y >= 0 && atCeiling(&monsterp->object))
-	{ StopObject(&monsterp->object,VERTICAL); }
-      //Give monsters gravity
-      if(monsterp->object.speed.y <= 0 && onFloor(&monsterp->object))
-	{ StopObject(&monsterp->object,VERTICAL); }
-      else if(monsterp->object.speed.y > -0.5)
-	{ monsterp->object.speed.y -= 0.05; }
-      else if(monsterp->object.speed.y == 0)
-	{ monsterp->object.center.y = TILE_CENTER_Y; }
-      
-      //Make sure monsters don't go diagonally through corners
-      if(atCorner(&monsterp->object,monsterp->object.speed) &&
-	 !(monsterp->object.speed.x == 0 && monsterp->object.speed.y == 0))
-	{
-	  if(abs(monsterp->object.speed.x) > abs(monsterp->object.speed.y))
-	    { StopObject(&monsterp->object,HORIZONTAL); }
-	  else
-	    { StopObject(&monsterp->object,VERTICAL); }
+	  Uint64 bits = SolidRun(low, high - low + 1, y);
+	  if (bits != 0)
+	    {
+	      found = y;
+	      square->x = low + __builtin_ctzll(bits);
+	      square->y = y;
+	    }
 	}
     }
-
-  //Remove any monsters that happen to be dead and have fallen to the bottom of the
-  //game area.
-  struct object_list **next;
-  for(struct object_list **monsterp = &g_monsters; *monsterp != NULL; monsterp = next)
-    {
-      next = &((*monsterp)->next_object);
-      if(!(**monsterp).object.alive && (**monsterp).object.location.y <= BOTTOM)
-	{ DestroyObject(monsterp); }
-    }
+  if (found < 0)
+    { return -1; }
+  return forward ? found * size - edge : edge - (found + 1) * size;
 }
 
-void UpdateState()
+/*
+  Sweeps 'box' 'delta' pixels along 'axis' (HORIZONTAL or VERTICAL).
+  Only reads the solidity map, the grid and the stores, so it's safe to
+  call from several threads at once. The object 'self' doesn't get in
+  its own way.
+*/
+struct contact Sweep(struct box box, int axis, int delta, struct entity_ref self)
 {
-  //If player is still, center it
-  if(player.speed.x == 0)
-    { player.center.x = TILE_CENTER_X; }
+  struct contact contact = {delta, FALSE, {NOTHING, NO_HANDLE}, FALSE};
+  if (delta == 0)
+    { return contact; }
   
-  //Stop player if he hits a wall
-  if((player.speed.x >= 0 && atRightWall(&player)) ||
-     (player.speed.x <= 0 && atLeftWall(&player)))
+  //Work with the leading edge and how far it can go
+  int forward = (delta > 0);
+  int reach = forward ? delta : -delta;
+  int edge, limit;
+  if (axis == HORIZONTAL)
     {
-      if(player.speed.x < 0)
-	{ blocked_right = TRUE; }
-      else if(player.speed.x > 0)
-	{ blocked_left = TRUE; }
-      StopObject(&player,HORIZONTAL);
+      edge = forward ? box.right : box.left;
+      limit = forward ? (RIGHT + 1) * TILE_WIDTH - edge : edge;
     }
-  
-  //Keep player from going through ceilings
-  if(player.speed.y >= 0 && atCeiling(&player))
-    { StopObject(&player,VERTICAL); }
-  //Create gravity for player
-  if(player.speed.y <= 0 && onFloor(&player))
-    { StopObject(&player,VERTICAL); }
-  else if(player.speed.y > -0.5)
-    { player.speed.y -= 0.05; }
-  else if(player.speed.y == 0)
-    { player.center.y = TILE_CENTER_Y; }
-  
-  //Make sure player doesn't go diagonally through corners
-  if(atCorner(&player,player.speed) && !(player.speed.x == 0 && player.speed.y == 0))
-    {
-      if(abs(player.speed.x) > abs(player.speed.y))
-	{ StopObject(&player,HORIZONTAL); }
-      else
-	{ StopObject(&player,VERTICAL); }
+  else
+    {
+      edge = forward ? box.top : box.bottom;
+      limit = forward ? (TOP + 1) * TILE_HEIGHT - edge : edge;
+    }
+  if (limit < reach)
+    {
+      reach = limit < 0 ? 0 : limit;
+      contact.blocked = TRUE;
     }
   
-  //Detect collisions between player and monsters:
-  //Kill the monster if the player lands on it, but kill the player
-  //otherwise.
-  if(grid[player.location.x][player.location.y-1] != NULL &&
-     grid[player.location.x][player.location.y-1]->type == MONSTER)
-    {
-      grid[player.location.x][player.location.y-1]->alive = FALSE;
-      grid[player.location.x][player.location.y-1] = NULL;
-    }
-  else if((player.location.y != TOP &&
-	   grid[player.location.x][player.location.y+1] != NULL &&
-	   grid[player.location.x][player.location.y+1]->type == MONSTER) ||
-	  (player.location.x != LEFT &&
-	   grid[player.location.x-1][player.location.y] != NULL &&
-	   grid[player.location.x-1][player.location.y]->type == MONSTER) ||
-	  (player.location.x != RIGHT &&
-	   grid[player.location.x+1][player.location.y] != NULL &&
-	   grid[player.location.x+1][player.location.y]->type == MONSTER))
-    { player.alive = FALSE; }
-  
-  //Every second, spawn a new monster in one of the top two corners
-  static time_t last_time = 0;
-  time_t now = time(NULL);
-  if (difftime(now, last_time) > 1)
-    {
-      struct point center = {TILE_CENTER_X, TILE_CENTER_Y};
-      struct vector speed = {0, 0};
-      struct point location = {LEFT,TOP};
-      if(rand()%10 >= 5)
-	{ location.x = RIGHT; }
-      CreateObject(&g_monsters, location, center, speed, &monster_icon, MONSTER);
-      last_time = time(NULL);
-    }
-  
-  //update the monsters
-  UpdateMonsters();
-  
-  //change the player's location
-  MoveObject(&player, &player.speed);
+  //Platforms are found from the solidity map
+  struct point square;
+  int gap = SolidGap(box, axis, forward, edge, reach, &square);
+  if (gap >= 0 && (gap < reach || !contact.blocked))
+    {
+      reach = gap;
+      contact.blocked = TRUE;
+      contact.with = FindInCell(square.x, square.y, PLATFORM);
+    }
   
-  //change the monsters' locations
-  for(struct object_list *monsterp = g_monsters; monsterp != NULL; monsterp = monsterp->next_object)
+  //Look at the bodies near the path the box sweeps out
+  struct box swept = box;
+  if (axis == HORIZONTAL && forward)
+    { swept.right += reach; }
+  else if (axis == HORIZONTAL)
+    { swept.left -= reach; }
+  else if (forward)
+    { swept.top += reach; }
+  else
+    { swept.bottom -= reach; }
+  struct view_walk walk;
+  for(struct entity_ref ref = FirstInView(&walk, SquaresNear(swept)); ref.type != NOTHING; ref = NextInView(&walk))
     {
-      if(monsterp->object.alive)
-	{ MoveObject(&(monsterp->object), &(monsterp->object.speed)); }
+      if ((ref.type == self.type && ref.id == self.id) || ref.type == PLATFORM)
+	{ continue; }
+      contact.crowded = TRUE;
+      
+      //Skip what isn't level with the box, and what's behind or
+      //already overlapping it
+      struct box other = BoxOf(ref);
+      int gap;
+      if (axis == HORIZONTAL)
+	{
+	  if (other.top <= box.bottom || other.bottom >= box.top)
+	    { continue; }
+	  gap = forward ? other.left - box.right : box.left - other.right;
+	}
+      else
+	{
+	  if (other.right <= box.left || other.left >= box.right)
+	    { continue; }
+	  gap = forward ? other.bottom - box.top : box.bottom - other.top;
+	}
+      if (gap < 0 || gap > reach || (gap == reach && contact.blocked))
+	{ continue; }
+      reach = gap;
+      contact.blocked = TRUE;
+      contact.with = ref;
     }
+  
+  contact.distance = forward ? reach : -reach;
+  return contact;
 }
 
-//Render the game state
-void RenderState(SDL_Surface *screen)
-{   
-  if ( SDL_MUSTLOCK(screen) )
+//The result of moving a body: where it ends up, the subpixels past
+//that, and what it ran into on each axis.
+struct body_move
+{
+  struct point to;
+  struct point fraction;
+  struct contact x;
+  struct contact y;
+};
+
+//Returns the whole pixels in 'subpixels,' rounded down, so that what's
+//left over is never negative.
+int WholePixels(int subpixels)
+{
+  if (subpixels < 0)
+    { return -((-subpixels + SUBPIXELS - 1) >> SUBPIXEL_BITS); }
+  return subpixels >> SUBPIXEL_BITS;
+}
+
+//Returns 'speed' after a tick of falling.
+int Fall(int speed)
+{ return (speed > -FALL_LIMIT) ? speed - GRAVITY : speed; }
+
+//Sweeps a body at 'pixel,' and 'fraction' subpixels past it, along
+//'speed,' first across and then up or down. The whole pixels reached
+//are swept and the rest carried in the result's 'fraction;' a body
+//that runs into something stops flush against it, with none left.
+struct body_move SweepBody(struct point pixel, struct point fraction, struct vector speed, struct entity_ref self)
+{
+  struct body_move move;
+  int x = fraction.x + speed.x, y = fraction.y + speed.y;
+  move.x = Sweep(BodyBox(pixel), HORIZONTAL, WholePixels(x), self);
+  pixel.x += move.x.distance;
+  move.fraction.x = move.x.blocked ? 0 : x - WholePixels(x) * SUBPIXELS;
+  move.y = Sweep(BodyBox(pixel), VERTICAL, WholePixels(y), self);
+  pixel.y += move.y.distance;
+  move.fraction.y = move.y.blocked ? 0 : y - WholePixels(y) * SUBPIXELS;
+  move.to = pixel;
+  return move;
+}
+
+//Returns TRUE if the body 'self' at 'pixel' is standing on something.
+enum boolean Resting(struct point pixel, struct entity_ref self)
+{ return Sweep(BodyBox(pixel), VERTICAL, -1, self).blocked; }
+
+enum boolean PlayerResting()
+{
+  struct entity_ref self = {PLAYER, NO_HANDLE};
+  return Resting(PixelOf(game->player.location, game->player.center), self);
+}
+
+//Returns TRUE if a body at 'pixel' is standing on a platform or the
+//bottom of the game area. Unlike Resting, other bodies don't count.
+enum boolean OnSolid(struct point pixel)
+{
+  int bottom = pixel.y - BODY_HALF;
+  if (bottom == 0)
+    { return TRUE; }
+  
+  //The row its feet are on (or a pixel above), and the squares under it
+  int row = bottom / TILE_HEIGHT - 1;
+  if (row < BOTTOM || bottom % TILE_HEIGHT > 1)
+    { return FALSE; }
+  int left = (pixel.x - BODY_HALF) / TILE_WIDTH;
+  int right = (pixel.x + BODY_HALF - 1) / TILE_WIDTH;
+  return SolidRun(left, right - left + 1, row) != 0;
+}
+
+/*
+  OnSolid for 'count' bodies at once (at most 64): bit i of the result
+  is set if the body at 'pixels[i]' is standing on something. There's
+  a version of this that works on 4 bodies at a time with AVX2, picked
+  by SelectKernels where the CPU has it; both give the same answer.
+*/
+Uint64 OnSolidScalar(const struct point *pixels, int count)
+{
+  Uint64 standing = 0;
+  for(int i = 0; i < count; i++)
+    { standing |= (Uint64)OnSolid(pixels[i]) << i; }
+  return standing;
+}
+
+#if defined(HAVE_X86_KERNELS) && TILE_WIDTH == 32 && TILE_HEIGHT == 32 && CHUNK_SIZE == 16
+//Returns, in each lane where 'level' is set, the row 'row' of the
+//solid_block holding square 'column,' shifted so that square is bit 0,
+//and 0 in the others.
+__attribute__((target("avx2")))
+static inline __m256i SolidBitsAVX2(const int *solid_index, const int *solid, __m256i row, __m256i column,
+				    __m256i level, __m256i chunks_x, __m256i square_mask)
+{
+  //The mask of a 32-bit gather is the level mask packed down to 128 bits
+  __m128i level_32 = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(level, _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7)));
+  __m256i chunk = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(row, CHUNK_BITS), chunks_x),
+				   _mm256_srli_epi64(column, CHUNK_BITS));
+  __m256i block = _mm256_cvtepu32_epi64(_mm256_mask_i64gather_epi32(_mm_setzero_si128(), solid_index, chunk, level_32, 4));
+  
+  //Two rows of a block make up one 32-bit word
+  __m256i in_block = _mm256_and_si256(row, square_mask);
+  __m256i word = _mm256_add_epi64(_mm256_slli_epi64(block, CHUNK_BITS - 1), _mm256_srli_epi64(in_block, 1));
+  __m256i rows = _mm256_cvtepu32_epi64(_mm256_mask_i64gather_epi32(_mm_setzero_si128(), solid, word, level_32, 4));
+  __m256i shift = _mm256_add_epi64(_mm256_slli_epi64(_mm256_and_si256(in_block, _mm256_set1_epi64x(1)), 4),
+				   _mm256_and_si256(column, square_mask));
+  return _mm256_srlv_epi64(rows, shift);
+}
+
+__attribute__((target("avx2")))
+Uint64 OnSolidAVX2(const struct point *pixels, int count)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi64x(1);
+  const __m256i low_half = _mm256_set1_epi64x(0xffffffff);
+  const __m256i body_half = _mm256_set1_epi64x(BODY_HALF);
+  const __m256i chunks_x = _mm256_set1_epi64x(game->world.chunks_x);
+  const __m256i square_mask = _mm256_set1_epi64x(CHUNK_MASK);
+  const int *solid_index = (const int *)game->world.solid_index;
+  const int *solid = (const int *)game->world.solid;
+  Uint64 standing = 0;
+  int i = 0;
+  for(; i + 4 <= count; i += 4)
+    {
+      //Each lane is one point: x in the low half, y in the high half.
+      //Pixels are never negative, so the divisions are shifts.
+      __m256i at = _mm256_loadu_si256((const __m256i *)(pixels + i));
+      __m256i x = _mm256_and_si256(at, low_half);
+      __m256i bottom = _mm256_sub_epi64(_mm256_srli_epi64(at, 32), body_half);
+      __m256i row = _mm256_sub_epi64(_mm256_srli_epi64(bottom, 5), one);
+      __m256i above = _mm256_and_si256(bottom, _mm256_set1_epi64x(TILE_HEIGHT - 1));
+      __m256i level = _mm256_and_si256(_mm256_cmpgt_epi64(row, _mm256_set1_epi64x(-1)),
+				       _mm256_cmpgt_epi64(_mm256_set1_epi64x(2), above));
+      
+      //Fetch the rows of the blocks holding the squares under each
+      //side, only for the lanes that are level with a row
+      __m256i left = _mm256_srli_epi64(_mm256_sub_epi64(x, body_half), 5);
+      __m256i right = _mm256_srli_epi64(_mm256_add_epi64(x, _mm256_set1_epi64x(BODY_HALF - 1)), 5);
+      __m256i bits = _mm256_or_si256(SolidBitsAVX2(solid_index, solid, row, left, level, chunks_x, square_mask),
+				     SolidBitsAVX2(solid_index, solid, row, right, level, chunks_x, square_mask));
+      
+      __m256i on = _mm256_or_si256(_mm256_cmpeq_epi64(bottom, zero),
+				   _mm256_and_si256(level, _mm256_cmpeq_epi64(_mm256_and_si256(bits, one), one)));
+      standing |= (Uint64)_mm256_movemask_pd(_mm256_castsi256_pd(on)) << i;
+    }
+  for(; i < count; i++)
+    { standing |= (Uint64)OnSolid(pixels[i]) << i; }
+  return standing;
+}
+#define HAVE_ON_SOLID_AVX2
+#endif
+
+//The version of OnSolidScalar to use
+Uint64 (*on_solid)(const struct point *pixels, int count) = OnSolidScalar;
+
+//Puts the object 'self' at 'pixel,' moving it to another square of the
+//grid if need be.
+void PlaceAt(struct point *location, struct point *center, struct point pixel, struct entity_ref self)
+{
+  struct point square;
+  SquareOf(pixel, &square, center);
+  if (square.x != location->x || square.y != location->y)
+    { ChangeSquare(location, square, self); }
+}
+
+//Returns the first object of 'type' whose box overlaps 'box,' or
+//empty_cell if there isn't one.
+struct entity_ref FindOverlap(struct box box, enum ObjectType type, struct entity_ref self)
+{
+  struct view_walk walk;
+  for(struct entity_ref ref = FirstInView(&walk, SquaresNear(box)); ref.type != NOTHING; ref = NextInView(&walk))
+    {
+      if (ref.type != type || (ref.type == self.type && ref.id == self.id))
+	{ continue; }
+      struct box other = BoxOf(ref);
+      if (other.left < box.right && other.right > box.left &&
+	  other.bottom < box.top && other.top > box.bottom)
+	{ return ref; }
+    }
+  return empty_cell;
+}
+
+//Returns TRUE if a body could be put in the middle of square 'at'
+//without overlapping anything. Reads in that part of the map first.
+enum boolean RoomFor(struct point at)
+{
+  StreamAround(at);
+  struct point center = {TILE_CENTER_X, TILE_CENTER_Y};
+  struct box box = BodyBox(PixelOf(at, center));
+  struct view_walk walk;
+  for(struct entity_ref ref = FirstInView(&walk, SquaresNear(box)); ref.type != NOTHING; ref = NextInView(&walk))
+    {
+      struct box other = BoxOf(ref);
+      if (other.left < box.right && other.right > box.left &&
+	  other.bottom < box.top && other.top > box.bottom)
+	{ return FALSE; }
+    }
+  return TRUE;
+}
+
+/*********************************************************\
+                          Animation
+\*********************************************************/
+
+/*
+  Monsters and the player are drawn from animations: runs of frames
+  in the sprite atlas, each shown for some number of ticks. Animations
+  run on the tick clock, so all an object keeps is which one it's
+  playing and the tick it started; the frame to draw is worked out
+  from those when a snapshot is taken.
+
+  There's only one image of each sprite, so the frames are made from
+  it when it's loaded (see LoadAssets): copies squashed or stretched
+  to a shape, standing on the same spot, and mirrored for going left.
+  Walking bobs up and down, and a monster that's jumped on is
+  flattened.
+*/
+enum Animation {NO_ANIMATION, MONSTER_WALK, MONSTER_WALK_LEFT, MONSTER_DIE,
+		PLAYER_STAND, PLAYER_WALK, PLAYER_WALK_LEFT, ANIMATIONS};
+
+#define MAX_FRAMES 8
+
+//The size of a frame, in percent of the image it's made from
+struct frame_shape
+{
+  int width;
+  int height;
+};
+
+struct animation
+{
+  struct icon *image;
+  int ticks_per_frame;
+  enum boolean loop;
+  enum boolean mirrored;
+  int frame_count;
+  struct frame_shape shapes[MAX_FRAMES];
+  
+  //Made by LoadAssets
+  struct icon frames[MAX_FRAMES];
+};
+
+struct animation animations[ANIMATIONS] =
+  {
+    [MONSTER_WALK] = {&monster_icon, 3, TRUE, FALSE, 4, {{100, 100}, {108, 92}, {100, 100}, {94, 106}}},
+    [MONSTER_WALK_LEFT] = {&monster_icon, 3, TRUE, TRUE, 4, {{100, 100}, {108, 92}, {100, 100}, {94, 106}}},
+    [MONSTER_DIE] = {&monster_icon, 2, FALSE, FALSE, 5, {{110, 80}, {120, 60}, {130, 40}, {140, 25}, {150, 12}}},
+    [PLAYER_STAND] = {&player_icon, 1, TRUE, FALSE, 1, {{100, 100}}},
+    [PLAYER_WALK] = {&player_icon, 2, TRUE, FALSE, 4, {{100, 100}, {104, 94}, {100, 100}, {96, 104}}},
+    [PLAYER_WALK_LEFT] = {&player_icon, 2, TRUE, TRUE, 4, {{100, 100}, {104, 94}, {100, 100}, {96, 104}}},
+  };
+
+//Starts object 'i' of 'store' playing 'animation.'
+void Animate(struct entity_store *store, int i, enum Animation animation)
+{
+  store->animation[i] = animation;
+  store->animation_start[i] = game->animation_clock;
+}
+
+//Returns the frame to draw now of 'animation,' started on tick 'started.'
+struct icon *AnimationFrame(enum Animation animation, long started)
+{
+  struct animation *playing = &animations[animation];
+  long frame = (game->animation_clock - started) / playing->ticks_per_frame;
+  if (playing->loop)
+    { frame %= playing->frame_count; }
+  else if (frame >= playing->frame_count)
+    { frame = playing->frame_count - 1; }
+  return &playing->frames[frame];
+}
+
+/*********************************************************\
+                          Snapshots
+\*********************************************************/
+
+/*
+  The game is simulated on one thread and drawn on another. After each
+  tick the simulation copies what can be seen near the player into a
+  snapshot, and the renderer draws the newest snapshot there is, so
+  neither waits on the other, and the renderer never looks at the
+  world while it's changing.
+*/
+
+//Something to draw, moving from 'from' to 'to' (see PixelOf) over a tick
+struct sprite
+{
+  struct icon *icon;
+  struct point from;
+  struct point to;
+};
+
+//How far from the player, in squares, the screen can reach
+#define SNAPSHOT_REACH_X (WIDTH / TILE_WIDTH + 1)
+#define SNAPSHOT_REACH_Y (HEIGHT / TILE_HEIGHT + 1)
+#define SNAPSHOT_SQUARES ((2 * SNAPSHOT_REACH_X + 1) * (2 * SNAPSHOT_REACH_Y + 1))
+#define MAX_SPRITES (SNAPSHOT_SQUARES + MAX_CORPSES)
+
+//Monsters can pile up in a square; only the top few of a pile are drawn
+#define MAX_DRAWN_PER_SQUARE 8
+
+struct snapshot
+{
+  //When the tick was due, on the clock of Now()
+  double time;
+  
+  //How many key presses the simulation had acted on
+  long keys_applied;
+  
+  enum boolean player_alive;
+  enum boolean monsters_left;
+  struct sprite player;
+  struct point player_square;
+  
+  //The platforms near the player, and world.revision when they were copied
+  int revision;
+  int platform_count;
+  struct sprite platforms[SNAPSHOT_SQUARES];
+  
+  //The monsters near the player, living and dead
+  int sprite_count;
+  struct sprite sprites[MAX_SPRITES];
+};
+
+//Returns the squares that could be on screen while the camera follows
+//an object at 'at.'
+struct view SquaresAround(struct point at)
+{
+  struct view view = {at.x - SNAPSHOT_REACH_X, at.x + SNAPSHOT_REACH_X,
+		      at.y - SNAPSHOT_REACH_Y, at.y + SNAPSHOT_REACH_Y};
+  if (view.left < LEFT)
+    { view.left = LEFT; }
+  if (view.right > RIGHT)
+    { view.right = RIGHT; }
+  if (view.bottom < BOTTOM)
+    { view.bottom = BOTTOM; }
+  if (view.top > TOP)
+    { view.top = TOP; }
+  return view;
+}
+
+//Adds object 'i' of 'store' to the end of 'sprites,' if there's room.
+void AddSprite(struct sprite *sprites, int *count, int max, struct entity_store *store, int i)
+{
+  if (*count == max)
+    { return; }
+  struct sprite *sprite = &sprites[(*count)++];
+  sprite->icon = store->icon[i];
+  if (store->animation[i] != NO_ANIMATION)
+    {
+      enum Animation animation = store->animation[i];
+      if (animation == MONSTER_WALK && store->speed[i].x < 0)
+	{ animation = MONSTER_WALK_LEFT; }
+      sprite->icon = AnimationFrame(animation, store->animation_start[i]);
+    }
+  sprite->from = store->previous[i];
+  sprite->to = PixelOf(store->location[i], store->center[i]);
+}
+
+//Copies what can be seen from around the player into 'snap.'
+void TakeSnapshot(struct snapshot *snap)
+{
+  snap->player_alive = game->player.alive;
+  snap->monsters_left = game->monsters.count > 0;
+  int speed = game->player.speed.x;
+  enum Animation walk = (speed > 0) ? PLAYER_WALK : (speed < 0) ? PLAYER_WALK_LEFT : PLAYER_STAND;
+  snap->player.icon = AnimationFrame(walk, 0);
+  snap->player.from = game->player.previous;
+  snap->player.to = PixelOf(game->player.location, game->player.center);
+  snap->player_square = game->player.location;
+  snap->revision = game->world.revision;
+  
+  struct view near = SquaresAround(game->player.location);
+  snap->platform_count = 0;
+  snap->sprite_count = 0;
+  for(int y = near.top; y >= near.bottom; y--)
+    for(int x = near.left; x <= near.right; x++)
+      {
+	struct entity_ref here[MAX_DRAWN_PER_SQUARE];
+	int count = CellOccupants(x, y, here, MAX_DRAWN_PER_SQUARE);
+	if (count > MAX_DRAWN_PER_SQUARE)
+	  { count = MAX_DRAWN_PER_SQUARE; }
+	for(int k = count - 1; k >= 0; k--)
+	  {
+	    struct entity_store *store = StoreOf(here[k].type);
+	    int i = (store == NULL) ? -1 : LookupObject(store, here[k].id);
+	    if (i < 0)
+	      { continue; }
+	    if (here[k].type == PLATFORM)
+	      { AddSprite(snap->platforms, &snap->platform_count, SNAPSHOT_SQUARES, store, i); }
+	    else
+	      { AddSprite(snap->sprites, &snap->sprite_count, MAX_SPRITES, store, i); }
+	  }
+      }
+  
+  //The dead have left the grid, so look for them separately
+  for(int c = 0; c < game->corpses.count; c++)
+    {
+      int i = LookupObject(&game->monsters, game->corpses.id[c]);
+      if (i < 0)
+	{ continue; }
+      struct point at = game->monsters.location[i];
+      if (at.x >= near.left && at.x <= near.right && at.y >= near.bottom && at.y <= near.top)
+	{ AddSprite(snap->sprites, &snap->sprite_count, MAX_SPRITES, &game->monsters, i); }
+    }
+}
+
+/*
+  Snapshots pass from the simulation to the renderer through three
+  buffers: the one being written, the one being drawn, and the newest
+  finished one between them. Each side swaps its own buffer for the one
+  in the middle, so neither ever has to wait for the other.
+*/
+#define SNAPSHOT_FRESH 4
+struct snapshot_buffers
+{
+  int writing;
+  int reading;
+  
+  //Shared by both; SNAPSHOT_FRESH is set until the renderer takes it
+  int newest;
+  
+  struct snapshot slot[3];
+} snapshots = {.writing = 0, .reading = 2, .newest = 1};
+
+//Returns the snapshot for the simulation to fill in next
+struct snapshot *SnapshotToWrite()
+{ return &snapshots.slot[snapshots.writing]; }
+
+//Hands the snapshot just written to the renderer
+void FinishSnapshot()
+{
+  int old = __atomic_exchange_n(&snapshots.newest, snapshots.writing | SNAPSHOT_FRESH, __ATOMIC_ACQ_REL);
+  snapshots.writing = old & ~SNAPSHOT_FRESH;
+}
+
+//Returns the newest finished snapshot for the renderer to draw
+struct snapshot *SnapshotToRead()
+{
+  if (__atomic_load_n(&snapshots.newest, __ATOMIC_ACQUIRE) & SNAPSHOT_FRESH)
+    {
+      int old = __atomic_exchange_n(&snapshots.newest, snapshots.reading, __ATOMIC_ACQ_REL);
+      snapshots.reading = old & ~SNAPSHOT_FRESH;
+    }
+  return &snapshots.slot[snapshots.reading];
+}
+
+/********************************************************************\
+                           Pixel Kernels
+\********************************************************************/
+
+/*
+  The inner loops of drawing, for 32-bit pixels: filling a rectangle,
+  copying a sprite but skipping its colorkey, and blending a sprite by
+  its alpha channel. Pitches are in bytes, as in SDL_Surface. Each has
+  a plain C version and, on x86, SSE2 and AVX2 versions; the best the
+  CPU supports is picked at startup by SelectKernels. All versions give
+  exactly the same pixels.
+*/
+struct pixel_kernels
+{
+  const char *name;
+  void (*fill)(Uint32 *dst, int dst_pitch, int w, int h, Uint32 color);
+  void (*blit_colorkey)(Uint32 *dst, int dst_pitch, const Uint32 *src, int src_pitch,
+			int w, int h, Uint32 key, Uint32 key_mask);
+  void (*blit_alpha)(Uint32 *dst, int dst_pitch, const Uint32 *src, int src_pitch,
+		     int w, int h);
+};
+
+//Moves a pixel pointer on by 'pitch' bytes
+#define NEXT_ROW(pixels, pitch) ((void *)((Uint8 *)(pixels) + (pitch)))
+
+//Mixes one 8-bit channel of 'src' over 'dst' by 'alpha,' rounding
+//x/255 the way the vector versions do.
+Uint32 BlendChannel(Uint32 src, Uint32 dst, Uint32 alpha)
+{
+  Uint32 x = src * alpha + dst * (255 - alpha) + 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+//Blends one pixel; the alpha is the top byte of 'src.'
+Uint32 BlendPixel(Uint32 src, Uint32 dst)
+{
+  Uint32 alpha = src >> 24;
+  Uint32 out = 0;
+  for(int shift = 0; shift < 32; shift += 8)
+    { out |= BlendChannel((src >> shift) & 0xff, (dst >> shift) & 0xff, alpha) << shift; }
+  return out;
+}
+
+void FillScalar(Uint32 *dst, int dst_pitch, int w, int h, Uint32 color)
+{
+  for(int y = 0; y < h; y++, dst = NEXT_ROW(dst, dst_pitch))
+    for(int x = 0; x < w; x++)
+      { dst[x] = color; }
+}
+
+void BlitColorkeyScalar(Uint32 *dst, int dst_pitch, const Uint32 *src, int src_pitch,
+			int w, int h, Uint32 key, Uint32 key_mask)
+{
+  for(int y = 0; y < h; y++, dst = NEXT_ROW(dst, dst_pitch), src = NEXT_ROW(src, src_pitch))
+    for(int x = 0; x < w; x++)
+      {
+	if((src[x] & key_mask) != key)
+	  { dst[x] = src[x]; }
+      }
+}
+
+void BlitAlphaScalar(Uint32 *dst, int dst_pitch, const Uint32 *src, int src_pitch, int w, int h)
+{
+  for(int y = 0; y < h; y++, dst = NEXT_ROW(dst, dst_pitch), src = NEXT_ROW(src, src_pitch))
+    for(int x = 0; x < w; x++)
+      { dst[x] = BlendPixel(src[x], dst[x]); }
+}
+
+const struct pixel_kernels scalar_kernels =
+  { "scalar", FillScalar, BlitColorkeyScalar, BlitAlphaScalar };
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse2")))
+void FillSSE2(Uint32 *dst, int dst_pitch, int w, int h, Uint32 color)
+{
+  __m128i fill = _mm_set1_epi32(color);
+  for(int y = 0; y < h; y++, dst = NEXT_ROW(dst, dst_pitch))
+    {
+      int x = 0;
+      for(; x + 4 <= w; x += 4)
+	{ _mm_storeu_si128((__m128i *)(dst + x), fill); }
+      for(; x < w; x++)
+	{ dst[x] = color; }
+    }
+}
+
+__attribute__((target("sse2")))
+void BlitColorkeySSE2(Uint32 *dst, int dst_pitch, const Uint32 *src, int src_pitch,
+		      int w, int h, Uint32 key, Uint32 key_mask)
+{
+  __m128i keys = _mm_set1_epi32(key);
+  __m128i mask = _mm_set1_epi32(key_mask);
+  for(int y = 0; y < h; y++, dst = NEXT_ROW(dst, dst_pitch), src = NEXT_ROW(src, src_pitch))
+    {
+      int x = 0;
+      for(; x + 4 <= w; x += 4)
+	{
+	  __m128i s = _mm_loadu_si128((const __m128i *)(src + x));
+	  __m128i d = _mm_loadu_si128((const __m128i *)(dst + x));
+	  __m128i keyed = _mm_cmpeq_epi32(_mm_and_si128(s, mask), keys);
+	  d = _mm_or_si128(_mm_and_si128(keyed, d), _mm_andnot_si128(keyed, s));
+	  _mm_storeu_si128((__m128i *)(dst + x), d);
+	}
+      for(; x < w; x++)
+	{
+	  if((src[x] & key_mask) != key)
+	    { dst[x] = src[x]; }
+	}
+    }
+}
+
+//Blends two pixels held as 16-bit channels
+__attribute__((target("sse2")))
+static inline __m128i BlendSSE2(__m128i s, __m128i d)
+{
+  __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff);
+  __m128i inverse = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+  __m128i x = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s, alpha), _mm_mullo_epi16(d, inverse)),
+			    _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+void BlitAlphaSSE2(Uint32 *dst, int dst_pitch, const Uint32 *src, int src_pitch, int w, int h)
+{
+  __m128i zero = _mm_setzero_si128();
+  for(int y = 0; y < h; y++, dst = NEXT_ROW(dst, dst_pitch), src = NEXT_ROW(src, src_pitch))
+    {
+      int x = 0;
+      for(; x + 4 <= w; x += 4)
+	{
+	  __m128i s = _mm_loadu_si128((const __m128i *)(src + x));
+	  __m128i d = _mm_loadu_si128((const __m128i *)(dst + x));
+	  __m128i low = BlendSSE2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+	  __m128i high = BlendSSE2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+	  _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(low, high));
+	}
+      for(; x < w; x++)
+	{ dst[x] = BlendPixel(src[x], dst[x]); }
+    }
+}
+
+const struct pixel_kernels sse2_kernels =
+  { "sse2", FillSSE2, BlitColorkeySSE2, BlitAlphaSSE2 };
+
+__attribute__((target("avx2")))
+void FillAVX2(Uint32 *dst, int dst_pitch, int w, int h, Uint32 color)
+{
+  __m256i fill = _mm256_set1_epi32(color);
+  for(int y = 0; y < h; y++, dst = NEXT_ROW(dst, dst_pitch))
+    {
+      int x = 0;
+      for(; x + 8 <= w; x += 8)
+	{ _mm256_storeu_si256((__m256i *)(dst + x), fill); }
+      for(; x < w; x++)
+	{ dst[x] = color; }
+    }
+}
+
+__attribute__((target("avx2")))
+void BlitColorkeyAVX2(Uint32 *dst, int dst_pitch, const Uint32 *src, int src_pitch,
+		      int w, int h, Uint32 key, Uint32 key_mask)
+{
+  __m256i keys = _mm256_set1_epi32(key);
+  __m256i mask = _mm256_set1_epi32(key_mask);
+  for(int y = 0; y < h; y++, dst = NEXT_ROW(dst, dst_pitch), src = NEXT_ROW(src, src_pitch))
+    {
+      int x = 0;
+      for(; x + 8 <= w; x += 8)
+	{
+	  __m256i s = _mm256_loadu_si256((const __m256i *)(src + x));
+	  __m256i d = _mm256_loadu_si256((const __m256i *)(dst + x));
+	  __m256i keyed = _mm256_cmpeq_epi32(_mm256_and_si256(s, mask), keys);
+	  _mm256_storeu_si256((__m256i *)(dst + x), _mm256_blendv_epi8(s, d, keyed));
+	}
+      for(; x < w; x++)
+	{
+	  if((src[x] & key_mask) != key)
+	    { dst[x] = src[x]; }
+	}
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i BlendAVX2(__m256i s, __m256i d)
+{
+  __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xff), 0xff);
+  __m256i inverse = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha);
+  __m256i x = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s, alpha), _mm256_mullo_epi16(d, inverse)),
+			       _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+void BlitAlphaAVX2(Uint32 *dst, int dst_pitch, const Uint32 *src, int src_pitch, int w, int h)
+{
+  __m256i zero = _mm256_setzero_si256();
+  for(int y = 0; y < h; y++, dst = NEXT_ROW(dst, dst_pitch), src = NEXT_ROW(src, src_pitch))
+    {
+      int x = 0;
+      for(; x + 8 <= w; x += 8)
+	{
+	  __m256i s = _mm256_loadu_si256((const __m256i *)(src + x));
+	  __m256i d = _mm256_loadu_si256((const __m256i *)(dst + x));
+	  __m256i low = BlendAVX2(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero));
+	  __m256i high = BlendAVX2(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero));
+	  _mm256_storeu_si256((__m256i *)(dst + x), _mm256_packus_epi16(low, high));
+	}
+      for(; x < w; x++)
+	{ dst[x] = BlendPixel(src[x], dst[x]); }
+    }
+}
+
+const struct pixel_kernels avx2_kernels =
+  { "avx2", FillAVX2, BlitColorkeyAVX2, BlitAlphaAVX2 };
+#endif
+
+//The kernels drawing goes through
+const struct pixel_kernels *kernels = &scalar_kernels;
+
+void SelectKernels()
+{
+  kernels = &scalar_kernels;
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    { kernels = &avx2_kernels; }
+  else if (__builtin_cpu_supports("sse2"))
+    { kernels = &sse2_kernels; }
+#endif
+#ifdef HAVE_ON_SOLID_AVX2
+  if (__builtin_cpu_supports("avx2"))
+    { on_solid = OnSolidAVX2; }
+#endif
+}
+
+//Whether the kernels can work on 'surface' directly: 32-bit pixels with
+//8-bit channels, any alpha in the top byte, and no RLE encoding.
+enum boolean KernelFormat(SDL_Surface *surface)
+{
+  SDL_PixelFormat *format = surface->format;
+  return (format->BytesPerPixel == 4 && !(surface->flags & SDL_RLEACCEL) &&
+	  (format->Amask == 0 || format->Amask == 0xff000000) &&
+	  (format->Rmask | format->Gmask | format->Bmask) == 0x00ffffff);
+}
+
+//Returns TRUE if the kernels can blit 'src' onto 'dst.'
+enum boolean KernelsCanBlit(SDL_Surface *src, SDL_Surface *dst)
+{
+  return (KernelFormat(src) && KernelFormat(dst) &&
+	  src->format->Rmask == dst->format->Rmask && src->format->Bmask == dst->format->Bmask &&
+	  ((src->flags & SDL_SRCCOLORKEY) || src->format->Amask != 0));
+}
+
+//KernelBlit, for surfaces already known to suit the kernels.
+void KernelBlitChecked(SDL_Surface *src, SDL_Rect *part, SDL_Surface *dst, SDL_Rect *dest)
+{
+  int x = dest->x, y = dest->y;
+  int src_x = part ? part->x : 0, src_y = part ? part->y : 0;
+  int w = part ? part->w : src->w, h = part ? part->h : src->h;
+  SDL_Rect clip = dst->clip_rect;
+  if (x < clip.x)
+    {
+      src_x += clip.x - x;
+      w -= clip.x - x;
+      x = clip.x;
+    }
+  if (y < clip.y)
+    {
+      src_y += clip.y - y;
+      h -= clip.y - y;
+      y = clip.y;
+    }
+  if (x + w > clip.x + clip.w)
+    { w = clip.x + clip.w - x; }
+  if (y + h > clip.y + clip.h)
+    { h = clip.y + clip.h - y; }
+  if (w <= 0 || h <= 0)
+    {
+      dest->w = dest->h = 0;
+      return;
+    }
+  dest->x = x;
+  dest->y = y;
+  dest->w = w;
+  dest->h = h;
+  
+  Uint32 *to = (Uint32 *)((Uint8 *)dst->pixels + y * dst->pitch) + x;
+  const Uint32 *from = (const Uint32 *)((Uint8 *)src->pixels + src_y * src->pitch) + src_x;
+  if (src->flags & SDL_SRCCOLORKEY)
+    { kernels->blit_colorkey(to, dst->pitch, from, src->pitch, w, h, src->format->colorkey, 0x00ffffff); }
+  else
+    { kernels->blit_alpha(to, dst->pitch, from, src->pitch, w, h); }
+}
+
+/*
+  Clips 'dest' to the clip rectangle of 'dst' and blits the part 'part'
+  of 'src' (or all of it, if NULL) there through the kernels, using the
+  colorkey if 'src' has one and its alpha channel otherwise. On return
+  'dest' is the part drawn, as with SDL_BlitSurface. Returns FALSE,
+  having drawn nothing, if the kernels can't handle the surfaces; the
+  caller should then use SDL.
+*/
+enum boolean KernelBlit(SDL_Surface *src, SDL_Rect *part, SDL_Surface *dst, SDL_Rect *dest)
+{
+  if (!KernelsCanBlit(src, dst))
+    { return FALSE; }
+  KernelBlitChecked(src, part, dst, dest);
+  return TRUE;
+}
+
+/*********************************************************\
+                            Assets
+\*********************************************************/
+
+/*
+  Images are loaded once, when the window opens, and converted to the
+  screen's pixel format then so drawing never has to. The sprites, and
+  the frames of the animations made from them, are packed in rows into
+  one atlas surface, and each icon is its own cell of it. If the pixel kernels can't draw the atlas to the screen,
+  SDL does, and the atlas is run-length encoded for it so the see-
+  through parts are skipped rather than tested pixel by pixel. The end
+  screens are loaded up front too, rather than as the game ends.
+*/
+struct sprite_asset
+{
+  const char *path;
+  struct icon *icon;
+};
+
+struct sprite_asset sprite_assets[] =
+  {
+    {"gingerbread.bmp", &player_icon},
+    {"block.bmp", &block_icon},
+    {"monster.bmp", &monster_icon},
+  };
+#define SPRITE_ASSETS (int)(sizeof(sprite_assets) / sizeof(sprite_assets[0]))
+
+//How wide the atlas can get before starting another row, and how many
+//cells it can have
+#define ATLAS_WIDTH 512
+#define MAX_CELLS   64
+
+struct asset_cache
+{
+  SDL_Surface *atlas;
+  int cells;
+  SDL_Surface *victory;
+  SDL_Surface *loss;
+  
+  //How long loading took
+  double load_seconds;
+} assets;
+
+double Now();
+
+/*
+  Loads a sprite, converting it to 32-bit pixels so the pixel kernels
+  can draw it. Black is see-through. Returns NULL, having said why, if
+  it can't be loaded or converted.
+*/
+SDL_Surface *LoadSprite(const char *path)
+{
+  SDL_Surface *image = SDL_LoadBMP(path);
+  if ( image == NULL )
+    {
+      fprintf(stderr, "Couldn't load %s: %s\n", path, SDL_GetError());
+      return NULL;
+    }
+  
+  SDL_Surface *sprite = SDL_CreateRGBSurface(SDL_SWSURFACE, image->w, image->h, 32,
+					     0x00ff0000, 0x0000ff00, 0x000000ff, 0);
+  if ( sprite == NULL )
+    {
+      fprintf(stderr, "Couldn't load %s: %s\n", path, SDL_GetError());
+      SDL_FreeSurface(image);
+      return NULL;
+    }
+  SDL_BlitSurface(image, NULL, sprite, NULL);
+  SDL_FreeSurface(image);
+  SDL_SetColorKey(sprite, SDL_SRCCOLORKEY, SDL_MapRGB(sprite->format, 0,0,0));
+  return sprite;
+}
+
+//Loads a whole-screen image in the screen's format.
+SDL_Surface *LoadScreenImage(const char *path)
+{
+  SDL_Surface *image = SDL_LoadBMP(path);
+  if ( image == NULL )
+    {
+      fprintf(stderr, "Couldn't load %s: %s\n", path, SDL_GetError());
+      return NULL;
+    }
+  
+  SDL_Surface *converted = SDL_DisplayFormat(image);
+  if ( converted == NULL )
+    { return image; }
+  SDL_FreeSurface(image);
+  return converted;
+}
+
+/*
+  Draws a frame of 'shape' made from 'image' into the part 'place' of
+  'sheet,' centred and standing on the bottom edge, and mirrored if
+  'mirrored' is set. Both surfaces must have 32-bit pixels.
+*/
+void MakeFrame(SDL_Surface *image, struct frame_shape shape, enum boolean mirrored,
+	       SDL_Surface *sheet, SDL_Rect place)
+{
+  int left = (image->w - image->w * shape.width / 100) / 2;
+  int top = image->h - image->h * shape.height / 100;
+  for(int y = 0; y < place.h; y++)
+    {
+      Uint32 *to = (Uint32 *)((Uint8 *)sheet->pixels + (place.y + y) * sheet->pitch) + place.x;
+      for(int x = 0; x < place.w; x++)
+	{
+	  int from_x = (x - left) * 100 / shape.width;
+	  int from_y = (y - top) * 100 / shape.height;
+	  if (x < left || y < top || from_x >= image->w || from_y >= image->h)
+	    {
+	      to[x] = 0;
+	      continue;
+	    }
+	  if (mirrored)
+	    { from_x = image->w - 1 - from_x; }
+	  to[x] = ((Uint32 *)((Uint8 *)image->pixels + from_y * image->pitch))[from_x];
+	}
+    }
+}
+
+//Gives 'icon' the next cell of the atlas, 'w' by 'h,' in 'row' or a new
+//row after it if it's full. 'width' is kept as the widest row so far.
+//Returns FALSE if there are no cells left.
+enum boolean PlaceCell(struct icon *icon, int w, int h, SDL_Rect *row, int *width)
+{
+  if (assets.cells == MAX_CELLS)
+    { return FALSE; }
+  if (row->x + w > ATLAS_WIDTH && row->x > 0)
+    {
+      row->y += row->h;
+      row->x = row->h = 0;
+    }
+  SDL_Rect place = {row->x, row->y, w, h};
+  icon->source = place;
+  icon->cell = assets.cells++;
+  row->x += w;
+  if (h > row->h)
+    { row->h = h; }
+  if (row->x > *width)
+    { *width = row->x; }
+  return TRUE;
+}
+
+//Loads every image the game draws, for drawing on 'screen.'
+void LoadAssets(SDL_Surface *screen)
+{
+  double start = Now();
+  
+  //Load the sprites and work out where they and the animations' frames
+  //go in the atlas
+  SDL_Surface *loaded[SPRITE_ASSETS];
+  SDL_Rect row = {0, 0, 0, 0};
+  int width = 0;
+  for(int i = 0; i < SPRITE_ASSETS; i++)
+    {
+      loaded[i] = LoadSprite(sprite_assets[i].path);
+      if (loaded[i] != NULL)
+	{ PlaceCell(sprite_assets[i].icon, loaded[i]->w, loaded[i]->h, &row, &width); }
+    }
+  SDL_Surface *made_from[ANIMATIONS];
+  for(int a = 0; a < ANIMATIONS; a++)
+    {
+      struct animation *animation = &animations[a];
+      made_from[a] = NULL;
+      for(int i = 0; i < SPRITE_ASSETS; i++)
+	{
+	  if (sprite_assets[i].icon == animation->image)
+	    { made_from[a] = loaded[i]; }
+	}
+      for(int f = 0; f < animation->frame_count && made_from[a] != NULL; f++)
+	{
+	  animation->frames[f].center = animation->image->center;
+	  if (!PlaceCell(&animation->frames[f], made_from[a]->w, made_from[a]->h, &row, &width))
+	    { made_from[a] = NULL; }
+	}
+    }
+  int height = row.y + row.h;
+  
+  //Copy the sprites in and make the frames, then convert the lot in one go
+  SDL_Surface *sheet = NULL;
+  if (width > 0)
+    {
+      sheet = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height, 32,
+				   0x00ff0000, 0x0000ff00, 0x000000ff, 0);
+      if (sheet == NULL)
+	{
+	  fprintf(stderr, "Couldn't create sprite atlas: %s\n", SDL_GetError());
+	  exit(1);
+	}
+      SDL_FillRect(sheet, NULL, 0);
+    }
+  for(int a = 0; a < ANIMATIONS; a++)
+    {
+      struct animation *animation = &animations[a];
+      for(int f = 0; f < animation->frame_count && made_from[a] != NULL; f++)
+	{ MakeFrame(made_from[a], animation->shapes[f], animation->mirrored, sheet, animation->frames[f].source); }
+    }
+  for(int i = 0; i < SPRITE_ASSETS; i++)
+    {
+      if (loaded[i] == NULL)
+	{ continue; }
+      SDL_SetColorKey(loaded[i], 0, 0);
+      SDL_BlitSurface(loaded[i], NULL, sheet, &sprite_assets[i].icon->source);
+      SDL_FreeSurface(loaded[i]);
+    }
+  
+  if (sheet != NULL)
+    {
+      assets.atlas = SDL_DisplayFormat(sheet);
+      if (assets.atlas == NULL)
+	{ assets.atlas = sheet; }
+      else
+	{ SDL_FreeSurface(sheet); }
+      
+      Uint32 key = SDL_MapRGB(assets.atlas->format, 0,0,0);
+      SDL_SetColorKey(assets.atlas, SDL_SRCCOLORKEY, key);
+      if (!KernelsCanBlit(assets.atlas, screen))
+	{ SDL_SetColorKey(assets.atlas, SDL_SRCCOLORKEY | SDL_RLEACCEL, key); }
+      
+      for(int i = 0; i < SPRITE_ASSETS; i++)
+	{
+	  if (sprite_assets[i].icon->source.w > 0)
+	    { sprite_assets[i].icon->image = assets.atlas; }
+	}
+      for(int a = 0; a < ANIMATIONS; a++)
+	for(int f = 0; f < animations[a].frame_count && made_from[a] != NULL; f++)
+	  { animations[a].frames[f].image = assets.atlas; }
+    }
+  
+  assets.victory = LoadScreenImage("victory.bmp");
+  assets.loss = LoadScreenImage("loss.bmp");
+  assets.load_seconds = Now() - start;
+}
+
+//Prints how long the images took to load and to draw.
+void ReportAssets()
+{
+  if (assets.atlas != NULL)
+    {
+      printf("assets loaded in %.1f ms, %dx%d sprite atlas of %d cells drawn by %s\n",
+	     assets.load_seconds * 1e3, assets.atlas->w, assets.atlas->h, assets.cells,
+	     (assets.atlas->flags & SDL_RLEACCEL) ? "SDL (RLE)" : "the pixel kernels");
+    }
+  if (game->blits > 0)
+    {
+      printf("%ld icons drawn, %.0f ns each\n",
+	     game->blits, game->blit_seconds * 1e9 / game->blits);
+    }
+}
+
+/********************************************************************\
+                              Graphics
+\********************************************************************/
+
+//Sets the pixel signified by 'x' and 'y' to 'color.'
+void DrawPixel(SDL_Surface *screen, int x, int y, Uint32 color)
+{
+  Uint32 *bufp;
+    
+  bufp = (Uint32 *)screen->pixels + y*screen->pitch/4 + x;
+  *bufp = color;
+}
+
+//Sets the entire screen to 'color.'
+void ClearScreen(SDL_Surface *screen, Uint32 color)
+{
+  if (screen->format->BytesPerPixel == 4)
+    { kernels->fill((Uint32 *)screen->pixels, screen->pitch, screen->w, screen->h, color); }
+  else
+    { SDL_FillRect(screen, NULL, color); }
+}
+
+//Blits an icon to the screen location set by 'x' and 'y,' 
+//offset by the icon center. Returns the part of the screen drawn on.
+//Isn't timed; it's for the odd icon, and lists are for the rest.
+SDL_Rect DrawIcon(SDL_Surface *screen, struct icon *icon, int x, int y)
+{
+  SDL_Rect dest = {0, 0, 0, 0};
+  
+  if(icon->image == NULL)
+    { printf("Bad Image\n"); }
+  else 
+    {
+      dest.x = x - icon->center.x;
+      dest.y = y - icon->center.y;
+      dest.w = icon->source.w;
+      dest.h = icon->source.h;
+      if (!KernelBlit(icon->image, &icon->source, screen, &dest))
+	{ SDL_BlitSurface(icon->image, &icon->source, screen, &dest); }
+    }
+  return dest;
+}
+
+/*
+  The camera lets the screen show part of a map bigger than itself. It
+  holds the position of the screen's top-left corner in pixels, right
+  and down from the top-left corner of the game area. The player is
+  kept inside a box in the middle of the screen, and the camera only
+  moves when they push against its edges.
+*/
+struct point camera = {0, 0};
+
+#define CAMERA_MARGIN_X (WIDTH / 3)
+#define CAMERA_MARGIN_Y (HEIGHT / 3)
+
+//Keeps the camera on the player, who is drawn at 'pixel' (see PixelOf),
+//but within the game area.
+void UpdateCamera(struct point pixel)
+{
+  int x = pixel.x;
+  int y = (TOP + 1) * TILE_HEIGHT - (1 + pixel.y);
+  
+  if (x < camera.x + CAMERA_MARGIN_X)
+    { camera.x = x - CAMERA_MARGIN_X; }
+  else if (x > camera.x + WIDTH - CAMERA_MARGIN_X)
+    { camera.x = x - WIDTH + CAMERA_MARGIN_X; }
+  if (y < camera.y + CAMERA_MARGIN_Y)
+    { camera.y = y - CAMERA_MARGIN_Y; }
+  else if (y > camera.y + HEIGHT - CAMERA_MARGIN_Y)
+    { camera.y = y - HEIGHT + CAMERA_MARGIN_Y; }
+  
+  int max_x = (RIGHT + 1) * TILE_WIDTH - WIDTH;
+  int max_y = (TOP + 1) * TILE_HEIGHT - HEIGHT;
+  if (camera.x > max_x)
+    { camera.x = max_x; }
+  if (camera.y > max_y)
+    { camera.y = max_y; }
+  if (camera.x < 0)
+    { camera.x = 0; }
+  if (camera.y < 0)
+    { camera.y = 0; }
+}
+
+/*
+  Parts of the screen that moving objects were drawn on, so they can be
+  put back and sent to the display without touching the rest. If there
+  are too many to list, the whole screen is treated as dirty.
+*/
+#define MAX_DIRTY 1024
+struct dirty_list
+{
+  int count;
+  enum boolean overflow;
+  SDL_Rect rects[MAX_DIRTY];
+};
+
+void MarkDirty(struct dirty_list *dirty, SDL_Rect rect)
+{
+  if (dirty == NULL || rect.w == 0 || rect.h == 0)
+    { return; }
+  if (dirty->count == MAX_DIRTY)
+    { dirty->overflow = TRUE; }
+  else
+    { dirty->rects[dirty->count++] = rect; }
+}
+
+//Blits 'icon' to 'pixel' (see PixelOf) in the game area, as seen by
+//the camera. The area drawn on is added to 'dirty,' if given.
+void DrawObject(SDL_Surface *screen, struct icon *icon, struct point pixel, struct dirty_list *dirty)
+{
+  MarkDirty(dirty, DrawIcon(screen, icon, pixel.x - camera.x,
+			    (TOP + 1) * TILE_HEIGHT - (1 + pixel.y) - camera.y));
+}
+
+/*
+  Sprites are drawn from a list rather than one at a time. The list is
+  sorted by atlas cell, so that the blits one after another draw the
+  same frame from the same pixels, and whether the kernels can draw
+  from the atlas is decided once for each run of sprites from the
+  same surface rather than for each sprite. Sprites in the same cell
+  keep the order they were listed in.
+*/
+#define MAX_DRAWS MAX_SPRITES
+
+struct draw
+{
+  struct icon *icon;
+  
+  //Where on the screen the icon's center goes
+  int x;
+  int y;
+};
+
+struct draw_list
+{
+  int count;
+  struct draw draws[MAX_DRAWS];
+  struct draw sorted[MAX_DRAWS];
+};
+
+//Adds 'icon' to 'list,' to be drawn centered on 'pixel' (see PixelOf)
+//as seen by the camera.
+void ListIcon(struct draw_list *list, struct icon *icon, struct point pixel)
+{
+  if (list->count == MAX_DRAWS)
+    { return; }
+  struct draw *draw = &list->draws[list->count++];
+  draw->icon = icon;
+  draw->x = pixel.x - camera.x;
+  draw->y = (TOP + 1) * TILE_HEIGHT - (1 + pixel.y) - camera.y;
+}
+
+//Adds 'sprite' to 'list,' 'alpha' of the way through the tick from
+//where it was to where it is now.
+void ListSprite(struct draw_list *list, struct sprite *sprite, float alpha)
+{ ListIcon(list, sprite->icon, Interpolate(sprite->from, sprite->to, alpha)); }
+
+//Draws everything in 'list' and empties it. The areas drawn on are
+//added to 'dirty,' if given.
+void DrawList(SDL_Surface *screen, struct draw_list *list, struct dirty_list *dirty)
+{
+  double start = Now();
+  int first[MAX_CELLS + 1] = {0};
+  for(int i = 0; i < list->count; i++)
+    { first[list->draws[i].icon->cell + 1]++; }
+  for(int cell = 1; cell <= MAX_CELLS; cell++)
+    { first[cell] += first[cell - 1]; }
+  for(int i = 0; i < list->count; i++)
+    { list->sorted[first[list->draws[i].icon->cell]++] = list->draws[i]; }
+  
+  SDL_Surface *image = NULL;
+  enum boolean by_kernels = FALSE;
+  for(int i = 0; i < list->count; i++)
+    {
+      struct icon *icon = list->sorted[i].icon;
+      if (icon->image == NULL)
+	{
+	  printf("Bad Image\n");
+	  continue;
+	}
+      if (icon->image != image)
+	{
+	  image = icon->image;
+	  by_kernels = KernelsCanBlit(image, screen);
+	}
+      SDL_Rect dest = {list->sorted[i].x - icon->center.x, list->sorted[i].y - icon->center.y,
+		       icon->source.w, icon->source.h};
+      if (by_kernels)
+	{ KernelBlitChecked(image, &icon->source, screen, &dest); }
+      else
+	{ SDL_BlitSurface(image, &icon->source, screen, &dest); }
+      MarkDirty(dirty, dest);
+    }
+  game->blits += list->count;
+  game->blit_seconds += Now() - start;
+  list->count = 0;
+}
+
+//Draws the player to the screen at 'pixel,' and marks the corners of
+//the square 'at,' which it occupies.
+void DrawTortoise(SDL_Surface *screen, struct icon *icon, struct point pixel, struct point at, struct dirty_list *dirty)
+{
+  DrawObject(screen, icon, pixel, dirty);
+  
+  Uint32 color = SDL_MapRGB(screen->format, 255,255,255);
+
+  int left = at.x * TILE_WIDTH - camera.x;
+  int right = left + 31;
+  int top = (TOP - at.y) * TILE_HEIGHT - camera.y;
+  int bottom = top + 31;
+
+  DrawPixel(screen, left, top, color);
+  DrawPixel(screen, left, bottom, color);
+  DrawPixel(screen, right, top, color);
+  DrawPixel(screen, right, bottom, color);
+  
+  SDL_Rect square = {left, top, TILE_WIDTH, TILE_HEIGHT};
+  MarkDirty(dirty, square);
+}
+
+/*
+  Platforms never move, so rather than drawing them every frame they
+  are drawn once into 'background,' and the screen is patched up from
+  it: each frame, only what moving objects covered last frame is put
+  back, and only that and what they cover now is sent to the display.
+  The background is drawn again when the camera moves or more of the
+  map is loaded.
+*/
+struct render_cache
+{
+  SDL_Surface *background;
+  struct point camera;
+  int revision;
+  
+  //What the moving objects covered last frame and this one
+  struct dirty_list drawn[2];
+  int current;
+  
+  struct draw_list draws;
+  
+  //Everything to send to the display this frame
+  SDL_Rect present[2 * MAX_DIRTY];
+} render_cache;
+
+//Draws the platforms in 'snap' into the background if it's out of date.
+//Returns TRUE if it had to.
+enum boolean RefreshBackground(SDL_Surface *screen, struct snapshot *snap)
+{
+  if (render_cache.background == NULL)
+    {
+      SDL_PixelFormat *format = screen->format;
+      render_cache.background = SDL_CreateRGBSurface(SDL_SWSURFACE, WIDTH, HEIGHT, format->BitsPerPixel,
+						     format->Rmask, format->Gmask, format->Bmask, format->Amask);
+      if (render_cache.background == NULL)
+	{
+	  fprintf(stderr, "Couldn't create background: %s\n", SDL_GetError());
+	  exit(1);
+	}
+    }
+  else if (render_cache.camera.x == camera.x && render_cache.camera.y == camera.y &&
+	   render_cache.revision == snap->revision)
+    { return FALSE; }
+  
+  SDL_Surface *background = render_cache.background;
+  if ( SDL_MUSTLOCK(background) )
+    {
+      if ( SDL_LockSurface(background) < 0 )
+	{ return FALSE; }
+    }
+  ClearScreen(background, SDL_MapRGB(background->format, 0,0,0));
+  for(int i = 0; i < snap->platform_count; i++)
+    { ListSprite(&render_cache.draws, &snap->platforms[i], 0); }
+  DrawList(background, &render_cache.draws, NULL);
+  if ( SDL_MUSTLOCK(background) )
+    { SDL_UnlockSurface(background); }
+  
+  render_cache.camera = camera;
+  render_cache.revision = snap->revision;
+  return TRUE;
+}
+
+/*********************************************************\
+                           Sound
+\*********************************************************/
+
+/*
+  Sound effects are mixed in SDL's audio callback, on SDL's audio
+  thread, from samples made once when the window opens. The
+  simulation posts the effects to play through a queue that only it
+  adds to and only the callback takes from, the way keys reach the
+  simulation (see QueueKey), so neither ever waits on the other or on
+  SDL_LockAudio. An effect posted while the queue is full is dropped.
+  
+  The callback fills 'audio_samples' samples at a time. Fewer means
+  effects are heard sooner, but leaves the device less to play if a
+  callback is late; one that comes more than a whole buffer after it
+  was due means the device ran dry, and is counted as an underrun.
+*/
+enum Sound {SOUND_JUMP, SOUND_STOMP, SOUND_DEATH, SOUND_SPAWN, SOUNDS};
+
+#define AUDIO_RATE       22050
+#define SOUND_QUEUE_SIZE 64
+#define MAX_VOICES       8
+#define MIX_CHUNK        256
+
+//How many samples the callback fills at a time, or 0 for no sound
+int audio_samples = 256;
+
+/*
+  How a sound is made: a tone sliding from 'from' to 'to' hertz over
+  'ms' milliseconds and fading out as it goes, 'noise' percent of it
+  noise, at 'volume' percent of full scale.
+*/
+struct sound_shape
+{
+  int from;
+  int to;
+  int ms;
+  int noise;
+  int volume;
+};
+
+struct sound_shape sound_shapes[SOUNDS] =
+  {
+    [SOUND_JUMP]  = {300, 700, 150, 0, 30},
+    [SOUND_STOMP] = {220, 60, 120, 30, 45},
+    [SOUND_DEATH] = {500, 60, 800, 10, 45},
+    [SOUND_SPAWN] = {900, 1200, 50, 0, 12},
+  };
+
+//A sound being played, 'played' samples into it
+struct voice
+{
+  Uint8 sound;
+  int played;
+};
+
+struct audio
+{
+  enum boolean open;
+  Sint16 *samples[SOUNDS];
+  int length[SOUNDS];
+  
+  //Effects posted by the simulation and not yet started
+  unsigned int head;
+  unsigned int tail;
+  Uint8 queue[SOUND_QUEUE_SIZE];
+  
+  //Only the callback touches these
+  struct voice voices[MAX_VOICES];
+  int playing;
+  double last_callback;
+  long callbacks;
+  long underruns;
+  double mix_seconds;
+  
+  //Effects the simulation found no room for
+  long dropped;
+} audio;
+
+//Posts 'sound' to be played, if it's the game in the window doing it
+//and sound is on. Only the simulation thread may call this.
+void PlaySound(enum Sound sound)
+{
+  if (!audio.open || game != &interactive_game)
+    { return; }
+  unsigned int tail = audio.tail;
+  if (tail - __atomic_load_n(&audio.head, __ATOMIC_ACQUIRE) == SOUND_QUEUE_SIZE)
+    {
+      audio.dropped++;
+      return;
+    }
+  audio.queue[tail % SOUND_QUEUE_SIZE] = sound;
+  __atomic_store_n(&audio.tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+//Makes the samples of 'sound' from its shape.
+void MakeSound(enum Sound sound)
+{
+  struct sound_shape shape = sound_shapes[sound];
+  int length = AUDIO_RATE * shape.ms / 1000;
+  Sint16 *samples = Allocate(length * sizeof(Sint16));
+  double phase = 0;
+  Uint32 noise = 1;
+  for(int i = 0; i < length; i++)
+    {
+      double through = (double)i / length;
+      phase += 2 * M_PI * (shape.from + (shape.to - shape.from) * through) / AUDIO_RATE;
+      noise = noise * 1664525 + 1013904223;
+      double level = sin(phase) * (100 - shape.noise) + (noise / 2147483648.0 - 1) * shape.noise;
+      samples[i] = level * shape.volume * (1 - through) * (32767 / 1e4);
+    }
+  audio.samples[sound] = samples;
+  audio.length[sound] = length;
+}
+
+//Starts the effects posted since the last callback, each in place of
+//the sound furthest through if every voice is busy.
+void StartPostedSounds()
+{
+  unsigned int head = audio.head;
+  unsigned int tail = __atomic_load_n(&audio.tail, __ATOMIC_ACQUIRE);
+  for(; head != tail; head++)
+    {
+      int v = 0;
+      if (audio.playing < MAX_VOICES)
+	{ v = audio.playing++; }
+      else
+	{
+	  for(int k = 1; k < MAX_VOICES; k++)
+	    {
+	      if (audio.voices[k].played > audio.voices[v].played)
+		{ v = k; }
+	    }
+	}
+      audio.voices[v].sound = audio.queue[head % SOUND_QUEUE_SIZE];
+      audio.voices[v].played = 0;
+    }
+  __atomic_store_n(&audio.head, head, __ATOMIC_RELEASE);
+}
+
+//SDL's audio callback: mixes 'len' bytes of whatever is playing into
+//'stream.'
+void MixAudio(void *unused, Uint8 *stream, int len)
+{
+  (void)unused;
+  double start = Now();
+  if (audio.callbacks++ > 0 && start - audio.last_callback > 2.0 * audio_samples / AUDIO_RATE)
+    { audio.underruns++; }
+  audio.last_callback = start;
+  StartPostedSounds();
+  
+  Sint16 *out = (Sint16 *)stream;
+  int count = len / sizeof(Sint16);
+  for(int done = 0; done < count; done += MIX_CHUNK)
+    {
+      int n = (count - done < MIX_CHUNK) ? count - done : MIX_CHUNK;
+      Sint32 mix[MIX_CHUNK] = {0};
+      for(int v = 0; v < audio.playing; v++)
+	{
+	  struct voice *voice = &audio.voices[v];
+	  const Sint16 *samples = audio.samples[voice->sound] + voice->played;
+	  int left = audio.length[voice->sound] - voice->played;
+	  int m = (left < n) ? left : n;
+	  for(int i = 0; i < m; i++)
+	    { mix[i] += samples[i]; }
+	  voice->played += m;
+	}
+      for(int i = 0; i < n; i++)
+	{ out[done + i] = (mix[i] > 32767) ? 32767 : (mix[i] < -32768) ? -32768 : mix[i]; }
+    }
+  
+  //Let go of the voices that have finished
+  for(int v = 0; v < audio.playing; )
+    {
+      if (audio.voices[v].played == audio.length[audio.voices[v].sound])
+	{ audio.voices[v] = audio.voices[--audio.playing]; }
+      else
+	{ v++; }
+    }
+  audio.mix_seconds += Now() - start;
+}
+
+//Makes the sounds and starts the callback, unless 'audio_samples' is
+//0. The game carries on without sound if it can't be opened.
+void OpenSound()
+{
+  if (audio_samples == 0)
+    { return; }
+  SDL_AudioSpec wanted;
+  memset(&wanted, 0, sizeof(wanted));
+  wanted.freq = AUDIO_RATE;
+  wanted.format = AUDIO_S16SYS;
+  wanted.channels = 1;
+  wanted.samples = audio_samples;
+  wanted.callback = MixAudio;
+  for(int sound = 0; sound < SOUNDS; sound++)
+    { MakeSound(sound); }
+  
+  //SDL converts from this format to the device's itself
+  if (SDL_OpenAudio(&wanted, NULL) < 0)
+    {
+      fprintf(stderr, "Playing without sound: %s\n", SDL_GetError());
+      return;
+    }
+  audio.open = TRUE;
+  SDL_PauseAudio(0);
+}
+
+//Stops the sound, then prints how the callback kept up.
+void ReportSound()
+{
+  if (!audio.open)
+    { return; }
+  SDL_CloseAudio();
+  audio.open = FALSE;
+  printf("sound: %ld callbacks of %d samples (%.1f ms), %ld underran, %.1f us to mix each, %ld effects dropped\n",
+	 audio.callbacks, audio_samples, audio_samples * 1e3 / AUDIO_RATE, audio.underruns,
+	 audio.callbacks ? audio.mix_seconds * 1e6 / audio.callbacks : 0, audio.dropped);
+}
+
+/*********************************************************\
+                         Environment
+\*********************************************************/
+
+//Takes an object from the pool and sets it up. Also adds a reference
+//in grid to new object. Returns NO_HANDLE if the pool is exhausted.
+Uint32 CreateObject(struct entity_store *objects, struct point location, struct point center, struct vector speed, struct icon *icon, enum ObjectType object_type)
+{
+  if (objects->free_slot < 0)
+    {
+      game->counters.exhausted++;
+      return NO_HANDLE;
+    }
+  
+  int slot = objects->free_slot;
+  objects->free_slot = objects->slot_index[slot];
+  if (slot >= objects->slots_touched)
+    { objects->slots_touched = slot + 1; }
+  
+  int i = objects->count++;
+  objects->slot_index[slot] = i;
+  objects->id[i] = objects->slot_generation[slot] << SLOT_BITS | slot;
+  objects->location[i] = location;
+  objects->center[i] = center;
+  objects->speed[i] = speed;
+  objects->fraction[i].x = 0;
+  objects->fraction[i].y = 0;
+  objects->icon[i] = icon;
+  objects->alive[i] = TRUE;
+  objects->type[i] = object_type;
+  objects->previous[i] = PixelOf(location, center);
+  objects->animation[i] = NO_ANIMATION;
+  game->counters.created++;
+  
+  struct entity_ref ref = {object_type, objects->id[i]};
+  AddToCell(location.x, location.y, ref);
+  return objects->id[i];
+}
+
+/*
+  Returns object 'i' to the pool, moving the last object into its
+  place. Bumping the slot's generation makes every handle to the
+  object stale, including any the grid still holds.
+*/
+void DestroyObject(struct entity_store *objects, int i)
+{
+  struct entity_ref ref = {objects->type[i], objects->id[i]};
+  RemoveFromCell(objects->location[i].x, objects->location[i].y, ref);
+  
+  Uint32 slot = objects->id[i] & SLOT_MASK;
+  objects->slot_generation[slot] = (objects->slot_generation[slot] % MAX_GENERATION) + 1;
+  objects->slot_index[slot] = objects->free_slot;
+  objects->free_slot = slot;
+  game->counters.destroyed++;
+  
+  int last = --objects->count;
+  if (i == last)
+    { return; }
+  
+  objects->location[i] = objects->location[last];
+  objects->center[i] = objects->center[last];
+  objects->speed[i] = objects->speed[last];
+  objects->fraction[i] = objects->fraction[last];
+  objects->icon[i] = objects->icon[last];
+  objects->alive[i] = objects->alive[last];
+  objects->type[i] = objects->type[last];
+  objects->previous[i] = objects->previous[last];
+  objects->animation[i] = objects->animation[last];
+  objects->animation_start[i] = objects->animation_start[last];
+  objects->id[i] = objects->id[last];
+  objects->slot_index[objects->id[i] & SLOT_MASK] = i;
+}
+
+//Creates a new monster at 'location' moving with 'speed.'
+void SpawnMonsterAt(struct point location, struct vector speed)
+{
+  struct point center = {TILE_CENTER_X, TILE_CENTER_Y};
+  StreamAround(location);
+  Uint32 id = CreateObject(&game->monsters, location, center, speed, &monster_icon, MONSTER);
+  if (id != NO_HANDLE)
+    {
+      Animate(&game->monsters, LookupObject(&game->monsters, id), MONSTER_WALK);
+      PlaySound(SOUND_SPAWN);
+    }
+}
+
+/*
+  A square that's blocked is tried again SPAWN_RETRY_TICKS later, and
+  each time it's still blocked the wait doubles, up to SPAWN_RETRY_LIMIT
+  ticks, so a corner that stays crowded isn't searched over and over.
+  The wait goes back to the start once a monster gets out.
+*/
+#define SPAWN_RETRY_TICKS 5
+#define SPAWN_RETRY_LIMIT 160
+
+//Returns how long to wait after finding a square blocked, having last
+//waited 'wait' ticks for it (0 if it wasn't blocked before).
+int RetryAfter(int wait)
+{
+  if (wait == 0)
+    { return SPAWN_RETRY_TICKS; }
+  return (2 * wait < SPAWN_RETRY_LIMIT) ? 2 * wait : SPAWN_RETRY_LIMIT;
+}
+
+//Drops a new monster into one of the top two corners, unless there's
+//something in the way or the corner was blocked and hasn't been waited
+//for yet.
+void SpawnMonster()
+{
+  struct vector speed = {0, 0};
+  struct point location = {LEFT,TOP};
+  int corner = 0;
+  if(Random()%10 >= 5)
+    {
+      location.x = RIGHT;
+      corner = 1;
+    }
+  if(game->animation_clock < game->corner_due[corner])
+    {
+      game->counters.no_room++;
+      return;
+    }
+  if(!RoomFor(location))
+    {
+      game->corner_wait[corner] = RetryAfter(game->corner_wait[corner]);
+      game->corner_due[corner] = game->animation_clock + game->corner_wait[corner];
+      game->counters.no_room++;
+      return;
+    }
+  game->corner_wait[corner] = 0;
+  SpawnMonsterAt(location, speed);
+}
+
+/*********************************************************\
+                          Spawners
+\*********************************************************/
+
+/*
+  Maps can put spawners anywhere: squares marked with a letter drop
+  monsters of the kind declared for that letter at the top of the map
+  file, so many squares can share one declaration. A declaration is
+  a line of the form
+
+    spawner LETTER PERIOD BURST KIND
+
+  and means a burst of BURST monsters of KIND every PERIOD ticks.
+  A burst's monsters come out a tick apart, as each would otherwise
+  land on the last, and a spawner with something in the way waits,
+  longer each time it's still blocked (see RetryAfter).
+*/
+struct monster_kind
+{
+  const char *name;
+  int speed;
+};
+
+//Monsters set off at 'speed' towards the middle of the map
+struct monster_kind monster_kinds[] =
+  {
+    {"walker", WALK_SPEED},
+    {"runner", 2 * WALK_SPEED},
+  };
+#define MONSTER_KINDS (int)(sizeof(monster_kinds) / sizeof(monster_kinds[0]))
+
+struct spawner
+{
+  struct point location;
+  int kind;
+  int period;
+  int burst;
+  
+  //Monsters left in the current burst, and when it started
+  int left;
+  long started;
+  
+  //How long it last waited for its square to clear (0 if it wasn't
+  //blocked)
+  int wait;
+  
+  //The tick it goes off next, and the next spawner in the same slot of
+  //the timer wheel (or -1)
+  long due;
+  int next;
+};
+
+/*
+  The spawners wait on a hierarchical timer wheel driven by the tick
+  count. Each level is a ring of WHEEL_SLOTS lists of spawners: level 0
+  has a slot per tick, level 1 a slot per WHEEL_SLOTS ticks, and so on.
+  A spawner goes in the lowest level that reaches its due tick, and
+  every time a level comes round, the next slot of the level above is
+  emptied into the levels below. A tick therefore only touches the
+  spawners due then (and, once in a while, those being moved down),
+  however many are waiting.
+*/
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_REACH  ((1L << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct timer_wheel
+{
+  long now;
+  int slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+struct spawner_list
+{
+  int count;
+  int capacity;
+  struct spawner *spawner;
+};
+
+//Empties every slot of the wheel and sets its clock back to 0.
+void ClearWheel()
+{
+  game->wheel->now = 0;
+  memset(game->wheel->slots, -1, sizeof(game->wheel->slots));
+}
+
+//Puts spawner 'i' on the wheel to go off on tick 'due,' which must be
+//no more than WHEEL_REACH ticks off.
+void Schedule(int i, long due)
+{
+  if (due < game->wheel->now)
+    { due = game->wheel->now; }
+  long delta = due - game->wheel->now;
+  
+  int level = 0;
+  while(delta >> (WHEEL_BITS * (level + 1)))
+    { level++; }
+  int *slot = &game->wheel->slots[level][(due >> (WHEEL_BITS * level)) & WHEEL_MASK];
+  game->spawners->spawner[i].due = due;
+  game->spawners->spawner[i].next = *slot;
+  *slot = i;
+}
+
+//Takes the list out of 'slot,' returning its first spawner.
+int TakeSlot(int *slot)
+{
+  int first = *slot;
+  *slot = -1;
+  return first;
+}
+
+//Drops one monster from spawner 'i' if there's room, and schedules
+//its next go.
+void FireSpawner(int i)
+{
+  struct spawner *spawner = &game->spawners->spawner[i];
+  if (spawner->left == 0)
+    {
+      spawner->left = spawner->burst;
+      spawner->started = game->wheel->now;
+    }
+  
+  if (!RoomFor(spawner->location))
+    {
+      spawner->wait = RetryAfter(spawner->wait);
+      Schedule(i, game->wheel->now + spawner->wait);
+      return;
+    }
+  spawner->wait = 0;
+  int speed = monster_kinds[spawner->kind].speed;
+  struct vector velocity = {2 * spawner->location.x < RIGHT ? speed : -speed, 0};
+  SpawnMonsterAt(spawner->location, velocity);
+  
+  //(A burst that was held up long enough starts the next one at once)
+  long next = game->wheel->now + 1;
+  if (--spawner->left == 0 && spawner->started + spawner->period > next)
+    { next = spawner->started + spawner->period; }
+  Schedule(i, next);
+}
+
+//Moves the clock on a tick and fires the spawners due.
+void AdvanceSpawners()
+{
+  game->wheel->now++;
+  
+  //Bring the spawners of the levels above down as each level comes round
+  for(int level = 1; level < WHEEL_LEVELS; level++)
+    {
+      if ((game->wheel->now >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK)
+	{ break; }
+      int slot = (game->wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+      for(int i = TakeSlot(&game->wheel->slots[level][slot]), next; i >= 0; i = next)
+	{
+	  next = game->spawners->spawner[i].next;
+	  Schedule(i, game->spawners->spawner[i].due);
+	}
+    }
+  
+  for(int i = TakeSlot(&game->wheel->slots[0][game->wheel->now & WHEEL_MASK]), next; i >= 0; i = next)
+    {
+      next = game->spawners->spawner[i].next;
+      FireSpawner(i);
+    }
+}
+
+/*********************************************************\
+                         Flow Field
+\*********************************************************/
+
+/*
+  Monsters find their way to the player by a flow field: the number of
+  moves from each square to the player's, found by one breadth-first
+  search back from the player. A monster on the ground just steps to
+  whichever side is closer, so thousands of them cost no more than one.
+
+  Monsters can walk along a platform and fall off its end, but can't
+  jump, so the search follows those moves backwards: a square is one
+  move from the squares beside it that have something underneath, and
+  from the square above. Squares that can't reach the player are left
+  unreached, and monsters there wander as before.
+
+  The field covers the FLOW_SIZE x FLOW_SIZE squares around the player,
+  which keeps it a fixed size however big the map is. Monsters outside
+  it get no field and wander too. It isn't patched as the player moves:
+  each time the player moves to another square the whole field is
+  searched again from the new one. A rebuild only touches the squares
+  it reaches (clearing the last one's by its queue), so it costs at
+  most FLOW_SIZE x FLOW_SIZE squares; --bench-flow times it. Where the
+  platforms are comes from the solidity map, so parts of the map not
+  read in yet count as well.
+*/
+#define FLOW_BITS      7
+#define FLOW_SIZE      (1 << FLOW_BITS)
+#define FLOW_MASK      (FLOW_SIZE - 1)
+#define FLOW_UNREACHED 0xFFFF
+
+struct flow_field
+{
+  //The square in the bottom left corner of the field, and the one it
+  //leads to
+  struct point origin;
+  struct point target;
+  enum boolean built;
+  
+  //Squares reached by the last build, in the order reached
+  int reached;
+  Uint32 queue[FLOW_SIZE * FLOW_SIZE];
+  
+  Uint16 distance[FLOW_SIZE * FLOW_SIZE];
+};
+
+//Forgets the field, so the next tick builds it afresh.
+void ClearFlowField()
+{
+  memset(game->flow->distance, 0xFF, sizeof(game->flow->distance));
+  game->flow->reached = 0;
+  game->flow->built = FALSE;
+}
+
+//Returns the moves from square ('x', 'y') to the player, or
+//FLOW_UNREACHED if it can't get there or is outside the field.
+int FlowDistance(int x, int y)
+{
+  int fx = x - game->flow->origin.x, fy = y - game->flow->origin.y;
+  if (fx < 0 || fx >= FLOW_SIZE || fy < 0 || fy >= FLOW_SIZE)
+    { return FLOW_UNREACHED; }
+  return game->flow->distance[fy << FLOW_BITS | fx];
+}
+
+//Returns TRUE if a monster can be in square ('x', 'y').
+enum boolean Open(int x, int y)
+{ return x >= LEFT && x <= RIGHT && y >= BOTTOM && y <= TOP && !Solid(x, y); }
+
+//Returns TRUE if a monster in square ('x', 'y') would be standing on
+//something rather than falling.
+enum boolean Supported(int x, int y)
+{ return y == BOTTOM || Solid(x, y - 1); }
+
+//Adds square ('x', 'y') to the search 'distance' moves from the target,
+//if it's in the field and not already reached.
+void Reach(int x, int y, int distance)
+{
+  int fx = x - game->flow->origin.x, fy = y - game->flow->origin.y;
+  if (fx < 0 || fx >= FLOW_SIZE || fy < 0 || fy >= FLOW_SIZE)
+    { return; }
+  Uint32 index = fy << FLOW_BITS | fx;
+  if (game->flow->distance[index] != FLOW_UNREACHED)
+    { return; }
+  game->flow->distance[index] = distance;
+  game->flow->queue[game->flow->reached++] = index;
+}
+
+//Rebuilds the field to lead to square 'target.'
+void BuildFlowField(struct point target)
+{
+  for(int i = 0; i < game->flow->reached; i++)
+    { game->flow->distance[game->flow->queue[i]] = FLOW_UNREACHED; }
+  game->flow->reached = 0;
+  game->flow->origin.x = target.x - FLOW_SIZE / 2;
+  game->flow->origin.y = target.y - FLOW_SIZE / 2;
+  game->flow->target = target;
+  game->flow->built = TRUE;
+  
+  if (!Open(target.x, target.y))
+    { return; }
+  Reach(target.x, target.y, 0);
+  for(int next = 0; next < game->flow->reached; next++)
+    {
+      Uint32 index = game->flow->queue[next];
+      int x = game->flow->origin.x + (index & FLOW_MASK);
+      int y = game->flow->origin.y + (index >> FLOW_BITS);
+      int distance = game->flow->distance[index] + 1;
+      if (distance == FLOW_UNREACHED)
+	{ continue; }
+      
+      //Falling in from above, or walking in from either side
+      if (Open(x, y + 1))
+	{ Reach(x, y + 1, distance); }
+      if (Open(x - 1, y) && Supported(x - 1, y))
+	{ Reach(x - 1, y, distance); }
+      if (Open(x + 1, y) && Supported(x + 1, y))
+	{ Reach(x + 1, y, distance); }
+    }
+}
+
+//Brings the field up to date with the player.
+void UpdateFlowField()
+{
+  struct point at = game->player.location;
+  if (!game->flow->built || game->flow->target.x != at.x || game->flow->target.y != at.y)
+    { BuildFlowField(at); }
+}
+
+/*********************************************************\
+                         Thread Pool
+\*********************************************************/
+
+/*
+  Workers for splitting a loop over many objects between threads. The
+  loop is cut into batches and each worker starts on a run of batches
+  of its own; a worker that finishes its run early steals batches from
+  the others' runs, so one slow thread doesn't hold up the rest. The
+  thread that asks for the work does a share of it too.
+*/
+#define MAX_WORKERS 64
+#define BATCH_SIZE 1024
+
+//How many threads share the work, counting the one asking; 0 for one
+//per CPU
+int worker_count = 0;
+
+//A run of batches. Its owner and thieves alike take batches from the
+//front, so they never take the same one.
+struct work_run
+{
+  int next;
+  int end;
+  
+  //Keep runs on cache lines of their own
+  char padding[64 - 2 * sizeof(int)];
+};
+
+struct thread_pool
+{
+  int workers;
+  SDL_Thread *threads[MAX_WORKERS];
+  SDL_mutex *lock;
+  SDL_cond *start;
+  SDL_cond *done;
+  
+  //Bumped to set the workers going on 'job'
+  int generation;
+  int busy;
+  enum boolean stopping;
+  
+  //The job, if one is running, and the game it's working on
+  void (*job)(int first, int last);
+  int items;
+  int batch_size;
+  struct game *game;
+  struct work_run runs[MAX_WORKERS];
+} pool = {.workers = 1};
+
+//Set on a thread while it's doing batches of a job
+__thread enum boolean in_job = FALSE;
+
+//Does batches of the current job until there are none left, starting
+//with worker 'self's own.
+void DoBatches(int self)
+{
+  for(int k = 0; k < pool.workers; k++)
+    {
+      struct work_run *run = &pool.runs[(self + k) % pool.workers];
+      int batch;
+      while((batch = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) < run->end)
+	{
+	  int first = batch * pool.batch_size;
+	  int last = first + pool.batch_size;
+	  pool.job(first, last < pool.items ? last : pool.items);
+	}
+    }
+}
+
+int Worker(void *data)
+{
+  int self = (intptr_t)data;
+  int seen = 0;
+  in_job = TRUE;
+  
+  SDL_mutexP(pool.lock);
+  while(1)
+    {
+      while(pool.generation == seen && !pool.stopping)
+	{ SDL_CondWait(pool.start, pool.lock); }
+      if(pool.stopping)
+	{ break; }
+      seen = pool.generation;
+      game = pool.game;
+      SDL_mutexV(pool.lock);
+      
+      DoBatches(self);
+      
+      SDL_mutexP(pool.lock);
+      if(--pool.busy == 0)
+	{ SDL_CondSignal(pool.done); }
+    }
+  SDL_mutexV(pool.lock);
+  return 0;
+}
+
+void StopWorkers()
+{
+  SDL_mutexP(pool.lock);
+  pool.stopping = TRUE;
+  SDL_CondBroadcast(pool.start);
+  SDL_mutexV(pool.lock);
+  for(int w = 1; w < pool.workers; w++)
+    { SDL_WaitThread(pool.threads[w], NULL); }
+  pool.workers = 1;
+}
+
+//Starts the workers asked for by 'worker_count.'
+void StartWorkers()
+{
+  int workers = worker_count;
+  if(workers <= 0)
+    { workers = sysconf(_SC_NPROCESSORS_ONLN); }
+  if(workers > MAX_WORKERS)
+    { workers = MAX_WORKERS; }
+  if(workers <= 1)
+    { return; }
+  
+  pool.lock = SDL_CreateMutex();
+  pool.start = SDL_CreateCond();
+  pool.done = SDL_CreateCond();
+  if(pool.lock == NULL || pool.start == NULL || pool.done == NULL)
+    {
+      fprintf(stderr, "Couldn't set up worker threads: %s\n", SDL_GetError());
+      exit(1);
+    }
+  for(pool.workers = 1; pool.workers < workers; pool.workers++)
+    {
+      pool.threads[pool.workers] = SDL_CreateThread(Worker, (void *)(intptr_t)pool.workers);
+      if(pool.threads[pool.workers] == NULL)
+	{ break; }
+    }
+  atexit(StopWorkers);
+}
+
+/*
+  Calls 'job' on batches of 'batch_size' of the numbers from 0 to
+  'items,' spread over the workers, and waits for it to finish. The
+  workers work on the calling thread's game. Small jobs aren't worth
+  splitting up, and the workers are already busy with any job started
+  from within a job, so those are done straight away. Only one thread
+  starts jobs at a time: the one playing the game (the simulation
+  thread in the window, the main thread otherwise), or the one playing
+  a batch, whose games' own jobs are started from within its job.
+*/
+void ParallelBatches(int items, int batch_size, void (*job)(int first, int last))
+{
+  if(pool.workers <= 1 || items < 2 * batch_size || in_job)
+    {
+      job(0, items);
+      return;
+    }
+  
+  int batches = (items + batch_size - 1) / batch_size;
+  SDL_mutexP(pool.lock);
+  for(int w = 0; w < pool.workers; w++)
+    {
+      pool.runs[w].next = batches * w / pool.workers;
+      pool.runs[w].end = batches * (w + 1) / pool.workers;
+    }
+  pool.job = job;
+  pool.items = items;
+  pool.batch_size = batch_size;
+  pool.game = game;
+  pool.busy = pool.workers - 1;
+  pool.generation++;
+  SDL_CondBroadcast(pool.start);
+  SDL_mutexV(pool.lock);
+  
+  in_job = TRUE;
+  DoBatches(0);
+  in_job = FALSE;
+  
+  SDL_mutexP(pool.lock);
+  while(pool.busy > 0)
+    { SDL_CondWait(pool.done, pool.lock); }
+  pool.job = NULL;
+  SDL_mutexV(pool.lock);
+}
+
+//ParallelBatches in batches of BATCH_SIZE, for loops over many objects.
+void ParallelFor(int items, void (*job)(int first, int last))
+{ ParallelBatches(items, BATCH_SIZE, job); }
+
+/*********************************************************\
+                        Frame Timing
+\*********************************************************/
+
+//Seconds on the monotonic clock, for timing frames and the simulation
+double Now()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+//Longest stretch of time the game will catch up on in one frame
+#define MAX_CATCH_UP 0.25
+
+//Statistics on the time between frames, to see how steady it is
+struct frame_stats
+{
+  long frames;
+  long ticks;
+  double total;
+  double sum_squares;
+  double shortest;
+  double longest;
+} frame_stats;
+
+void RecordFrame(double seconds)
+{
+  //The first frame's time is from when the loop started; skip it
+  if (frame_stats.frames++ == 0)
+    { return; }
+  frame_stats.total += seconds;
+  frame_stats.sum_squares += seconds * seconds;
+  if (frame_stats.frames == 2 || seconds < frame_stats.shortest)
+    { frame_stats.shortest = seconds; }
+  if (seconds > frame_stats.longest)
+    { frame_stats.longest = seconds; }
+}
+
+void ReportFrames()
+{
+  long timed = frame_stats.frames - 1;
+  if (timed < 1)
+    { return; }
+  double mean = frame_stats.total / timed;
+  double variance = frame_stats.sum_squares / timed - mean * mean;
+  printf("%ld frames, %ld ticks in %.1f s: %.1f frames/sec, %.1f ticks/sec\n",
+	 frame_stats.frames, frame_stats.ticks, frame_stats.total,
+	 timed / frame_stats.total, frame_stats.ticks / frame_stats.total);
+  printf("frame time %.2f ms average, %.2f ms jitter (std dev), %.2f to %.2f ms\n",
+	 mean * 1e3, sqrt(variance > 0 ? variance : 0) * 1e3,
+	 frame_stats.shortest * 1e3, frame_stats.longest * 1e3);
+}
+
+//Sleeps until 'when' on the monotonic clock (see Now).
+void SleepUntil(double when)
+{
+  struct timespec until;
+  until.tv_sec = (time_t)when;
+  until.tv_nsec = (long)((when - until.tv_sec) * 1e9);
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+    { }
+}
+
+/*
+  Input latency: each key press is stamped when it is read, and once the
+  simulation has acted on it, the time until the first frame showing
+  that is put on the screen is added to a histogram of whole
+  milliseconds. Key presses are numbered in the order they're read,
+  which is the order the simulation acts on them.
+*/
+#define MAX_WAITING_KEYS 64
+#define LATENCY_BUCKETS 1000
+
+struct input_latency
+{
+  long pressed_count;
+  long shown;
+  double pressed[MAX_WAITING_KEYS];
+  long histogram[LATENCY_BUCKETS];
+  long count;
+} input_latency;
+
+//Notes that a key was pressed just now.
+void KeyPressed()
+{
+  //If too many are waiting, forget the oldest
+  if (input_latency.pressed_count - input_latency.shown == MAX_WAITING_KEYS)
+    { input_latency.shown++; }
+  input_latency.pressed[input_latency.pressed_count++ % MAX_WAITING_KEYS] = Now();
+}
+
+//Notes that a frame showing the first 'applied' key presses acted on
+//was put on the screen just now.
+void FramePresented(long applied)
+{
+  if (input_latency.shown >= applied)
+    { return; }
+  double now = Now();
+  for(; input_latency.shown < applied; input_latency.shown++)
+    {
+      int ms = (now - input_latency.pressed[input_latency.shown % MAX_WAITING_KEYS]) * 1e3;
+      input_latency.histogram[ms < LATENCY_BUCKETS ? ms : LATENCY_BUCKETS - 1]++;
+      input_latency.count++;
+    }
+}
+
+//Returns the latency in milliseconds that 'fraction' of key presses
+//were shown within.
+int LatencyPercentile(double fraction)
+{
+  long seen = 0;
+  for(int ms = 0; ms < LATENCY_BUCKETS; ms++)
+    {
+      seen += input_latency.histogram[ms];
+      if (seen >= fraction * input_latency.count)
+	{ return ms; }
+    }
+  return LATENCY_BUCKETS - 1;
+}
+
+void ReportLatency()
+{
+  if (input_latency.count == 0)
+    { return; }
+  printf("input latency over %ld key presses: p50 %d ms, p99 %d ms\n",
+	 input_latency.count, LatencyPercentile(0.5), LatencyPercentile(0.99));
+}
+
+/*********************************************************\
+                          Profiler
+\*********************************************************/
+
+/*
+  The phases of a tick and of a frame are timed as they run: a phase
+  starts with ProfileStart, or where the one before it ended, and
+  Profile notes how long it took. Each phase runs on only one thread
+  (ticks on the simulation thread, frames on the main one), so its
+  figures have just the one writer.
+
+  The last PROFILE_WINDOW times of each phase are kept, for the
+  overlay (F3) and the report at exit to give the shortest, the
+  average and the 99th percentile of. With --trace, every time is also
+  kept to be written out at exit as a Chrome trace (open it in
+  chrome://tracing or Perfetto).
+
+  Timing is off in headless runs, unless they're traced, so it doesn't
+  count against the benchmarks.
+*/
+enum Phase {PHASE_UPDATE, PHASE_SPAWN, PHASE_FLOW, PHASE_PLAN, PHASE_MOVES, PHASE_REWIND, PHASE_SNAPSHOT,
+	    PHASE_EVENTS, PHASE_RENDER, PHASE_BACKGROUND, PHASE_SPRITES, PHASE_PRESENT, PHASES};
+
+//Phases from here on run on the main thread
+#define FIRST_MAIN_PHASE PHASE_EVENTS
+
+const char *phase_names[PHASES] =
+  {"update", "spawn", "flow", "plan", "moves", "rewind", "snapshot",
+   "events", "render", "background", "sprites", "present"};
+
+//Which phases are parts of the one above them
+const int phase_depth[PHASES] = {0, 1, 1, 1, 1, 0, 0, 0, 0, 1, 1, 1};
+
+//Colours of the phases on the overlay
+const Uint8 phase_colors[PHASES][3] =
+  {{80, 160, 255}, {120, 220, 120}, {60, 200, 200}, {240, 200, 60}, {240, 120, 40}, {200, 120, 240},
+   {160, 160, 160}, {255, 255, 255}, {255, 80, 80}, {160, 100, 60}, {255, 140, 200}, {120, 120, 255}};
+
+#define PROFILE_WINDOW 128
+#define TRACE_EVENTS   (1 << 16)
+
+struct trace_event
+{
+  double start;
+  float seconds;
+};
+
+struct phase_times
+{
+  //The last PROFILE_WINDOW times, in seconds, and how many there have been
+  float recent[PROFILE_WINDOW];
+  long count;
+  
+  struct trace_event *trace;
+  long traced;
+};
+
+struct profiler
+{
+  enum boolean on;
+  enum boolean overlay;
+  double started;
+  struct phase_times phases[PHASES];
+};
+
+//Where to write the trace to, if anywhere
+char *trace_file = NULL;
+
+//Returns the time to start a phase from, or 0 if timing is off.
+double ProfileStart()
+{ return game->profiler->on ? Now() : 0; }
+
+//Notes that 'phase' ran from 'start' until now. Returns now, for the
+//next phase to start from.
+double Profile(enum Phase phase, double start)
+{
+  if (!game->profiler->on)
+    { return 0; }
+  double now = Now();
+  float seconds = now - start;
+  struct phase_times *times = &game->profiler->phases[phase];
+  __atomic_store(&times->recent[times->count % PROFILE_WINDOW], &seconds, __ATOMIC_RELAXED);
+  __atomic_store_n(&times->count, times->count + 1, __ATOMIC_RELEASE);
+  if (times->trace != NULL && times->traced < TRACE_EVENTS)
+    {
+      times->trace[times->traced].start = start;
+      times->trace[times->traced++].seconds = seconds;
+    }
+  return now;
+}
+
+//Turns timing on, and starts a trace for 'trace_file' if it's set.
+void StartProfiler()
+{
+  game->profiler->on = TRUE;
+  game->profiler->started = Now();
+  if (trace_file != NULL)
+    {
+      for(int phase = 0; phase < PHASES; phase++)
+	{ game->profiler->phases[phase].trace = Allocate(TRACE_EVENTS * sizeof(struct trace_event)); }
+    }
+}
+
+struct phase_stats
+{
+  int samples;
+  float shortest;
+  float average;
+  float p99;
+};
+
+int CompareFloats(const void *a, const void *b)
+{
+  float x = *(const float *)a, y = *(const float *)b;
+  return (x > y) - (x < y);
+}
+
+//Works out the figures for the recent times of 'phase.'
+struct phase_stats PhaseStats(enum Phase phase)
+{
+  struct phase_times *times = &game->profiler->phases[phase];
+  float sorted[PROFILE_WINDOW];
+  struct phase_stats stats = {0, 0, 0, 0};
+  long count = __atomic_load_n(&times->count, __ATOMIC_ACQUIRE);
+  stats.samples = count < PROFILE_WINDOW ? count : PROFILE_WINDOW;
+  if (stats.samples == 0)
+    { return stats; }
+  for(int i = 0; i < stats.samples; i++)
+    {
+      __atomic_load(&times->recent[i], &sorted[i], __ATOMIC_RELAXED);
+      stats.average += sorted[i] / stats.samples;
+    }
+  qsort(sorted, stats.samples, sizeof(float), CompareFloats);
+  stats.shortest = sorted[0];
+  stats.p99 = sorted[(int)ceil(0.99 * stats.samples) - 1];
+  return stats;
+}
+
+//Draws a bar for each phase over the top left of the screen: the
+//average time as far as the bar goes, the shortest as a white mark
+//and the 99th percentile as a red one. The lines are a millisecond
+//apart. The area drawn on is added to 'dirty.'
+#define OVERLAY_X        8
+#define OVERLAY_Y        8
+#define OVERLAY_ROW      10
+#define OVERLAY_INDENT   6
+#define PIXELS_PER_MS    20
+#define OVERLAY_WIDTH    (OVERLAY_INDENT + 10 * PIXELS_PER_MS)
+
+void DrawProfile(SDL_Surface *screen, struct dirty_list *dirty)
+{
+  SDL_Rect panel = {OVERLAY_X - 2, OVERLAY_Y - 2, OVERLAY_WIDTH + 4, PHASES * OVERLAY_ROW + 2};
+  SDL_FillRect(screen, &panel, SDL_MapRGB(screen->format, 20, 20, 30));
+  for(int ms = 0; ms <= 10; ms++)
+    {
+      SDL_Rect line = {OVERLAY_X + OVERLAY_INDENT + ms * PIXELS_PER_MS, OVERLAY_Y, 1, PHASES * OVERLAY_ROW - 2};
+      SDL_FillRect(screen, &line, SDL_MapRGB(screen->format, 60, 60, 70));
+    }
+  for(int phase = 0; phase < PHASES; phase++)
+    {
+      struct phase_stats stats = PhaseStats(phase);
+      int x = OVERLAY_X + OVERLAY_INDENT * phase_depth[phase];
+      int y = OVERLAY_Y + phase * OVERLAY_ROW;
+      int limit = OVERLAY_X + OVERLAY_WIDTH - 2;
+      int average = x + stats.average * 1e3 * PIXELS_PER_MS;
+      int shortest = x + stats.shortest * 1e3 * PIXELS_PER_MS;
+      int p99 = x + stats.p99 * 1e3 * PIXELS_PER_MS;
+      SDL_Rect bar = {x, y, (average < limit ? average : limit) - x + 1, OVERLAY_ROW - 2};
+      SDL_Rect low = {shortest < limit ? shortest : limit, y, 1, OVERLAY_ROW - 2};
+      SDL_Rect high = {p99 < limit ? p99 : limit, y, 2, OVERLAY_ROW - 2};
+      const Uint8 *color = phase_colors[phase];
+      SDL_FillRect(screen, &bar, SDL_MapRGB(screen->format, color[0], color[1], color[2]));
+      SDL_FillRect(screen, &low, SDL_MapRGB(screen->format, 255, 255, 255));
+      SDL_FillRect(screen, &high, SDL_MapRGB(screen->format, 255, 0, 0));
+    }
+  MarkDirty(dirty, panel);
+}
+
+//Turns the overlay on or off, listing what its bars are when it's on.
+void ToggleOverlay()
+{
+  game->profiler->overlay = !game->profiler->overlay;
+  if (!game->profiler->overlay)
+    { return; }
+  printf("profile overlay, top to bottom (1 ms a line):");
+  for(int phase = 0; phase < PHASES; phase++)
+    { printf(" %s", phase_names[phase]); }
+  printf("\n");
+}
+
+void ReportProfile()
+{
+  if (!game->profiler->on)
+    { return; }
+  printf("phase times over the last %d, in ms: shortest, average, p99\n", PROFILE_WINDOW);
+  for(int phase = 0; phase < PHASES; phase++)
+    {
+      struct phase_stats stats = PhaseStats(phase);
+      if (stats.samples > 0)
+	{
+	  printf("  %*s%-*s %7.3f %7.3f %7.3f\n", 2 * phase_depth[phase], "", 12 - 2 * phase_depth[phase],
+		 phase_names[phase], stats.shortest * 1e3, stats.average * 1e3, stats.p99 * 1e3);
+	}
+    }
+}
+
+//Writes the trace, if there is one, in Chrome's trace event format,
+//the simulation's phases on one thread and the main loop's on another.
+void WriteTrace()
+{
+  if (trace_file == NULL || !game->profiler->on)
+    { return; }
+  FILE *out = fopen(trace_file, "w");
+  if (out == NULL)
+    {
+      fprintf(stderr, "Couldn't write trace %s\n", trace_file);
+      return;
+    }
+  fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fprintf(out, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"main\"}},\n");
+  fprintf(out, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 2, \"args\": {\"name\": \"simulation\"}}");
+  long dropped = 0;
+  for(int phase = 0; phase < PHASES; phase++)
+    {
+      struct phase_times *times = &game->profiler->phases[phase];
+      for(long i = 0; i < times->traced; i++)
+	{
+	  fprintf(out, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+		  phase_names[phase], phase < FIRST_MAIN_PHASE ? 2 : 1,
+		  (times->trace[i].start - game->profiler->started) * 1e6, times->trace[i].seconds * 1e6);
+	}
+      dropped += times->count - times->traced;
+    }
+  fprintf(out, "\n]}\n");
+  fclose(out);
+  printf("wrote trace to %s", trace_file);
+  if (dropped > 0)
+    { printf(" (%ld phases past the first %d of each left out)", dropped, TRACE_EVENTS); }
+  printf("\n");
+}
+
+/*********************************************************\
+                           Main Loop 
+\*********************************************************/
+
+/*
+  A headless game is stepped as fast as possible with no display, and
+  its 'spawn_rate' more monsters a tick are dropped into the top
+  corners on top of what the map's spawners make. The rate is kept in
+  whole shares of a monster, SPAWN_SHARES to a monster, so the spawns
+  add up the same on every machine.
+*/
+#define SPAWN_SHARES 256
+
+//Reads a rate of monsters per tick, rounded to the nearest share.
+int ParseSpawnRate(const char *text)
+{ return (int)lround(atof(text) * SPAWN_SHARES); }
+
+//The map to play on
+char *map_file = "map.txt";
+
+//Where to record the game to, if anywhere (see Replays)
+char *record_file = NULL;
+
+//The game is updated at a fixed rate however fast frames are drawn,
+//and frames are drawn at most 'frame_rate_cap' times a second
+//(or as fast as possible, if it is 0).
+#define TICKS_PER_SECOND 20
+#define TICK_SECONDS (1.0 / TICKS_PER_SECOND)
+int frame_rate_cap = 60;
+
+//Reads the platforms of chunk ('cx', 'cy') from the map file.
+void LoadChunk(int cx, int cy)
+{
+  Uint8 *state = &game->world.chunk_state[cy * game->world.chunks_x + cx];
+  if (*state != CHUNK_UNLOADED)
+    { return; }
+  *state = CHUNK_LOADED;
+  game->world.revision++;
+  
+  struct point center = {TILE_CENTER_X, TILE_CENTER_Y};
+  struct vector speed = {0, 0};
+  int left = cx * CHUNK_SIZE;
+  int width = (RIGHT - left + 1 < CHUNK_SIZE) ? RIGHT - left + 1 : CHUNK_SIZE;
+  for(int y = cy * CHUNK_SIZE; y < (cy + 1) * CHUNK_SIZE && y <= TOP; y++)
+    for(Uint64 bits = SolidRun(left, width, y); bits != 0; bits &= bits - 1)
+      {
+	struct point location = {left + __builtin_ctzll(bits), y};
+	CreateObject(&game->blocks, location, center, speed, &block_icon, PLATFORM);
+      }
+}
+
+//Makes sure the chunk holding 'at' and the chunks around it are loaded,
+//which covers every square the collision checks can look at from there.
+void StreamAround(struct point at)
+{
+  int cx = at.x >> CHUNK_BITS;
+  int cy = at.y >> CHUNK_BITS;
+  for(int y = cy - 1; y <= cy + 1; y++)
+    for(int x = cx - 1; x <= cx + 1; x++)
+      {
+	if (x >= 0 && x < game->world.chunks_x && y >= 0 && y < game->world.chunks_y)
+	  { LoadChunk(x, y); }
+      }
+}
+
+/*
+  Reads the spawner declarations at the top of 'map,' the map file
+  'path' (see Spawners), into 'kinds,' by letter, leaving the file at
+  the first row of the game area. Letters that aren't declared get a
+  period of 0.
+*/
+void ReadSpawnerKinds(FILE *map, const char *path, struct spawner kinds[26])
+{
+  memset(kinds, 0, 26 * sizeof(struct spawner));
+  
+  char line[256], letter, name[32];
+  int period, burst;
+  long start = ftell(map);
+  while(fgets(line, sizeof(line), map) != NULL && strncmp(line, "spawner ", 8) == 0)
+    {
+      int kind = MONSTER_KINDS;
+      if (sscanf(line, "spawner %c %d %d %31s", &letter, &period, &burst, name) == 4)
+	{
+	  kind = 0;
+	  while(kind < MONSTER_KINDS && strcmp(name, monster_kinds[kind].name) != 0)
+	    { kind++; }
+	}
+      if (kind == MONSTER_KINDS || letter < 'a' || letter > 'z' ||
+	  period < 1 || period > WHEEL_REACH || burst < 1)
+	{
+	  fprintf(stderr, "Map %s: bad spawner: %s", path, line);
+	  exit(1);
+	}
+      
+      struct spawner *declared = &kinds[letter - 'a'];
+      declared->kind = kind;
+      declared->period = period;
+      declared->burst = burst;
+      start = ftell(map);
+    }
+  fseek(map, start, SEEK_SET);
+}
+
+/*
+  Builds the game world from the map file 'path': each line is a row of
+  the game area, from the top down, and each '*' a platform. The world
+  is as wide as the longest row, and the rest of a shorter one is open.
+  The file is read twice: once to size the world, and once to fill in
+  the solidity map and find which chunks have platforms in them. The
+  platforms themselves are made on demand.
+  Also places the player and the first monsters, and sets the map's
+  spawners going.
+*/
+void ClearSaveStates();
+void SizeSaveStates();
+
+void LoadWorld(const char *path)
+{
+  FILE *map = fopen(path, "r");
+  if (map == NULL)
+    {
+      fprintf(stderr, "Couldn't open map %s\n", path);
+      exit(1);
+    }
+  
+  struct spawner kinds[26];
+  ReadSpawnerKinds(map, path, kinds);
+  long rows_start = ftell(map);
+  
+  //Find the lines and how wide the widest one is
+  int lines = 0, length = 0, c;
+  while((c = getc(map)) != EOF)
+    {
+      if (length == 0)
+	{ lines++; }
+      if (c == '\n')
+	{ length = 0; }
+      else if (c != '\r' && ++length > game->world.width)
+	{ game->world.width = length; }
+    }
+  game->world.height = lines;
+  if (game->world.width == 0 || game->world.height == 0)
+    {
+      fprintf(stderr, "Map %s is empty\n", path);
+      exit(1);
+    }
+  
+  game->world.chunks_x = (game->world.width + CHUNK_MASK) >> CHUNK_BITS;
+  game->world.chunks_y = (game->world.height + CHUNK_MASK) >> CHUNK_BITS;
+  game->world.chunks = Allocate(game->world.chunks_x * game->world.chunks_y * sizeof(struct chunk *));
+  memset(game->world.chunks, 0, game->world.chunks_x * game->world.chunks_y * sizeof(struct chunk *));
+  game->world.chunk_state = Allocate(game->world.chunks_x * game->world.chunks_y);
+  memset(game->world.chunk_state, CHUNK_EMPTY, game->world.chunks_x * game->world.chunks_y);
+  game->world.solid_index = Allocate(game->world.chunks_x * game->world.chunks_y * sizeof(Uint32));
+  memset(game->world.solid_index, 0, game->world.chunks_x * game->world.chunks_y * sizeof(Uint32));
+  game->world.solid_capacity = 64;
+  game->world.solid = Allocate(game->world.solid_capacity * sizeof(struct solid_block));
+  memset(&game->world.solid[0], 0, sizeof(struct solid_block));
+  game->world.solid_count = 1;
+  
+  //Note where the platforms are, which chunks have them and how many
+  //there are, and where the spawners are. Each square is placed by its
+  //own row and column, so nothing runs over from the next line.
+  fseek(map, rows_start, SEEK_SET);
+  game->world.block_count = 0;
+  ClearWheel();
+  ClearFlowField();
+  ClearSaveStates();
+  game->animation_clock = 0;
+  memset(game->corner_due, 0, sizeof(game->corner_due));
+  memset(game->corner_wait, 0, sizeof(game->corner_wait));
+  for(int x = 0, y = TOP; (c = getc(map)) != EOF; )
+    {
+      if (c == '\n')
+	{
+	  x = 0;
+	  y--;
+	}
+      else if (c != '\r')
+	{
+	  if (c == '*')
+	    {
+	      game->world.chunk_state[ChunkIndex(x, y)] = CHUNK_UNLOADED;
+	      SetSolid(x, y);
+	      game->world.block_count++;
+	    }
+	  else if (c >= 'a' && c <= 'z')
+	    {
+	      if (kinds[c - 'a'].period == 0)
+		{
+		  fprintf(stderr, "Map %s: no spawner '%c' declared\n", path, c);
+		  exit(1);
+		}
+	      if (game->spawners->count == game->spawners->capacity)
+		{
+		  game->spawners->capacity = game->spawners->capacity ? game->spawners->capacity * 2 : 64;
+		  struct spawner *grown = Allocate(game->spawners->capacity * sizeof(struct spawner));
+		  if (game->spawners->spawner != NULL)
+		    { memcpy(grown, game->spawners->spawner, game->spawners->count * sizeof(struct spawner)); }
+		  Release(game->spawners->spawner);
+		  game->spawners->spawner = grown;
+		}
+	      struct spawner *spawner = &game->spawners->spawner[game->spawners->count];
+	      *spawner = kinds[c - 'a'];
+	      spawner->location.x = x;
+	      spawner->location.y = y;
+	      Schedule(game->spawners->count++, spawner->period);
+	    }
+	  x++;
+	}
+    }
+  fclose(map);
+  SizeSaveStates();
+  
+  //The pools are set up on first use and reused by later worlds that fit
+  if (game->blocks.capacity < game->world.block_count)
+    {
+      FreeStore(&game->blocks);
+      InitStore(&game->blocks, game->world.block_count);
+    }
+  if (game->monsters.capacity == 0)
+    { InitStore(&game->monsters, game->max_monsters); }
+  
+  if (game->player.location.x > RIGHT)
+    { game->player.location.x = RIGHT; }
+  if (game->player.location.y > TOP)
+    { game->player.location.y = TOP; }
+  StreamAround(game->player.location);
+  struct entity_ref player_ref = {PLAYER, NO_HANDLE};
+  AddToCell(game->player.location.x, game->player.location.y, player_ref);
+  
+  //Create initial monsters
+  struct vector speed = {0, 0};
+  struct point location = {LEFT,TOP};
+  SpawnMonsterAt(location, speed);
+  location.x = RIGHT;
+  SpawnMonsterAt(location, speed);
+}
+
+//Tears down the game world and puts the player back at the start,
+//so another world can be loaded in the same process.
+void ClearWorld()
+{
+  while(game->blocks.count > 0)
+    { DestroyObject(&game->blocks, game->blocks.count - 1); }
+  while(game->monsters.count > 0)
+    { DestroyObject(&game->monsters, game->monsters.count - 1); }
+  
+  for(int i = 0; i < game->world.chunks_x * game->world.chunks_y; i++)
+    { Release(game->world.chunks[i]); }
+  Release(game->world.chunks);
+  Release(game->world.chunk_state);
+  Release(game->world.solid);
+  Release(game->world.solid_index);
+  memset(&game->world, 0, sizeof(struct world));
+  game->corpses.count = 0;
+  
+  Release(game->spawners->spawner);
+  memset(game->spawners, 0, sizeof(struct spawner_list));
+  ClearWheel();
+  ClearFlowField();
+  ClearSaveStates();
+  game->animation_clock = 0;
+  memset(game->corner_due, 0, sizeof(game->corner_due));
+  memset(game->corner_wait, 0, sizeof(game->corner_wait));
+  
+  struct point start = {10, 0};
+  struct point center = {TILE_CENTER_X, TILE_CENTER_Y};
+  struct vector still = {0, 0};
+  game->player.location = start;
+  game->player.center = center;
+  game->player.fraction.x = 0;
+  game->player.fraction.y = 0;
+  game->player.speed = still;
+  game->player.alive = TRUE;
+  game->player.previous = PixelOf(start, center);
+  game->player_links.next = empty_cell;
+  game->player_links.prev = empty_cell;
+  game->blocked_left = FALSE;
+  game->blocked_right = FALSE;
+}
+
+void initialize()
+{
+  //Initialize display
+  if ( SDL_Init(SDL_INIT_AUDIO|SDL_INIT_VIDEO) < 0 )
+    {
+      fprintf(stderr, "Unable to init SDL: %s\n", SDL_GetError());
+      exit(1);
+    }
+  atexit(SDL_Quit);
+  
+  LoadWorld(map_file);
+}
+
+/*
+  PlanMonster, CommitMoves and RemoveDead simulate the behavior of all
+  of the game's "monster" objects. The "physics" and "AI" associated
+  with them happen here.
+*/
+
+/*
+  Works out what monster 'i' does this tick: how its speed changes and
+  where it means to move (see CommitMoves). 'grounded' is whether it's
+  standing on a platform (see OnSolid). This only reads the grid and
+  only writes to monster 'i,' so monsters can be planned in any order,
+  on any number of threads, with the same result.
+*/
+#define PLAN_BLOCKED_X 1
+#define PLAN_BLOCKED_Y 2
+#define PLAN_CROWDED   4
+
+void PlanMonster(int i, enum boolean grounded)
+{
+  struct point *location = game->monsters.location;
+  struct point *center = game->monsters.center;
+  struct vector *speed = game->monsters.speed;
+  enum boolean *alive = game->monsters.alive;
+  
+  //If monster happens to be dead, merely cause it to fall some.
+  if(!alive[i])
+    {
+      if(location[i].y > 0)
+	{ location[i].y--; }
+      return;
+    }
+  
+  //Kill monsters that reach the end of their paths (bottom two corners),
+  //More are constantly spawned anyway.
+  if(location[i].y == BOTTOM &&
+     (location[i].x == RIGHT ||
+      location[i].x == LEFT))
+    {
+      alive[i] = FALSE;
+      return;
+    }
+
+  //Start moving if it's standing still next to a wall (or as near one
+  //as its square allows)
+  struct entity_ref self = {MONSTER, game->monsters.id[i]};
+  struct point pixel = PixelOf(location[i], center[i]);
+  if(speed[i].x == 0)
+    {
+      if(Sweep(BodyBox(pixel), HORIZONTAL, -(NEAR_WALL + 1), self).blocked)
+	{ speed[i].x = WALK_SPEED; }
+      else if(Sweep(BodyBox(pixel), HORIZONTAL, NEAR_WALL + 1, self).blocked)
+	{ speed[i].x = -WALK_SPEED; }
+    }
+  
+  //On a platform, head whichever way the flow field says is nearer
+  //the player. Like the field, this doesn't count standing on other
+  //monsters.
+  int here = FlowDistance(location[i].x, location[i].y);
+  if(grounded && here != FLOW_UNREACHED && here > 0)
+    {
+      int pace = (speed[i].x != 0) ? abs(speed[i].x) : WALK_SPEED;
+      if(FlowDistance(location[i].x - 1, location[i].y) < here)
+	{ speed[i].x = -pace; }
+      else if(FlowDistance(location[i].x + 1, location[i].y) < here)
+	{ speed[i].x = pace; }
+    }
+  
+  //Give monsters gravity
+  speed[i].y = Fall(speed[i].y);
+  
+  //See how far it gets before running into anything
+  struct body_move move = SweepBody(pixel, game->monsters.fraction[i], speed[i], self);
+  game->monsters.next_pixel[i] = move.to;
+  game->monsters.next_fraction[i] = move.fraction;
+  game->monsters.next_flags[i] = (move.x.blocked ? PLAN_BLOCKED_X : 0) |
+    (move.y.blocked ? PLAN_BLOCKED_Y : 0) |
+    (move.x.crowded || move.y.crowded ? PLAN_CROWDED : 0);
+}
+
+//Plans monsters 'first' to 'last,' asking which are on platforms 64
+//at a time.
+void PlanMonsters(int first, int last)
+{
+  struct point pixels[64];
+  for(int start = first; start < last; start += 64)
+    {
+      int count = (last - start < 64) ? last - start : 64;
+      for(int i = 0; i < count; i++)
+	{ pixels[i] = PixelOf(game->monsters.location[start + i], game->monsters.center[start + i]); }
+      Uint64 grounded = on_solid(pixels, count);
+      for(int i = 0; i < count; i++)
+	{ PlanMonster(start + i, (grounded >> i) & 1); }
+    }
+}
+
+/*
+  Moves the living monsters as planned, one at a time in order, so the
+  result never depends on how the planning was split up. Monsters that
+  had others near them when they planned are swept again, since those
+  others may have moved in the meantime.
+*/
+void CommitMoves()
+{
+  struct point *location = game->monsters.location;
+  struct point *center = game->monsters.center;
+  struct vector *speed = game->monsters.speed;
+  
+  for(int i = 0; i < game->monsters.count; i++)
+    {
+      if(!game->monsters.alive[i])
+	{ continue; }
+      
+      struct entity_ref self = {MONSTER, game->monsters.id[i]};
+      struct point to = game->monsters.next_pixel[i];
+      struct point fraction = game->monsters.next_fraction[i];
+      Uint8 flags = game->monsters.next_flags[i];
+      if(flags & PLAN_CROWDED)
+	{
+	  struct body_move move = SweepBody(PixelOf(location[i], center[i]), game->monsters.fraction[i], speed[i], self);
+	  to = move.to;
+	  fraction = move.fraction;
+	  flags = (move.x.blocked ? PLAN_BLOCKED_X : 0) | (move.y.blocked ? PLAN_BLOCKED_Y : 0);
+	}
+      
+      //When a monster hits an obstacle, have it reverse direction, and
+      //stop it falling when it lands
+      if(flags & PLAN_BLOCKED_X)
+	{ speed[i].x = -speed[i].x; }
+      if(flags & PLAN_BLOCKED_Y)
+	{ speed[i].y = 0; }
+      
+      PlaceAt(&location[i], &center[i], to, self);
+      game->monsters.fraction[i] = fraction;
+    }
+}
+
+//Removes the dead monsters that have fallen to the bottom of the game area
+void RemoveDead()
+{
+  struct point *location = game->monsters.location;
+  enum boolean *alive = game->monsters.alive;
+  
+  //Removal moves the last monster into slot 'i', so look at it again.
+  for(int i = 0; i < game->monsters.count; )
+    {
+      if(!alive[i] && location[i].y <= BOTTOM)
+	{ DestroyObject(&game->monsters, i); }
+      else
+	{ i++; }
+    }
+  
+  //Forget the corpses that have just been removed
+  int kept = 0;
+  for(int c = 0; c < game->corpses.count; c++)
+    {
+      if(LookupObject(&game->monsters, game->corpses.id[c]) >= 0)
+	{ game->corpses.id[kept++] = game->corpses.id[c]; }
+      else
+	{ game->counters.stale_refs++; }
+    }
+  game->corpses.count = kept;
+}
+
+//Remembers where everything is before it moves, so that frames drawn
+//between ticks can show objects part of the way along.
+void SavePositions()
+{
+  game->player.previous = PixelOf(game->player.location, game->player.center);
+  for(int i = 0; i < game->monsters.count; i++)
+    { game->monsters.previous[i] = PixelOf(game->monsters.location[i], game->monsters.center[i]); }
+}
+
+void UpdateState()
+{
+  double started = ProfileStart();
+  SavePositions();
+  game->animation_clock++;
+  
+  struct entity_ref player_ref = {PLAYER, NO_HANDLE};
+  struct point player_pixel = PixelOf(game->player.location, game->player.center);
+  
+  //Create gravity for player
+  game->player.speed.y = Fall(game->player.speed.y);
+  
+  //Detect collisions between player and monsters:
+  //Kill the monster if the player is standing on it, but kill the player
+  //if one touches it anywhere else.
+  struct box body = BodyBox(player_pixel);
+  struct box underfoot = {body.left, body.right, body.bottom - 1, body.bottom};
+  struct box around = {body.left - 1, body.right + 1, body.bottom, body.top + 1};
+  struct entity_ref below = FindOverlap(underfoot, MONSTER, player_ref);
+  if(below.type == MONSTER)
+    {
+      int i = LookupObject(&game->monsters, below.id);
+      game->monsters.alive[i] = FALSE;
+      Animate(&game->monsters, i, MONSTER_DIE);
+      RemoveFromCell(game->monsters.location[i].x, game->monsters.location[i].y, below);
+      if(game->corpses.count < MAX_CORPSES)
+	{ game->corpses.id[game->corpses.count++] = below.id; }
+      PlaySound(SOUND_STOMP);
+    }
+  else if(FindOverlap(around, MONSTER, player_ref).type == MONSTER)
+    {
+      if(game->player.alive)
+	{ PlaySound(SOUND_DEATH); }
+      game->player.alive = FALSE;
+    }
+  
+  //Set off the map's spawners that are due (and, headless, spawn as
+  //many more as the game's spawn rate allows this tick)
+  double phase = ProfileStart();
+  AdvanceSpawners();
+  if(game->headless)
+    {
+      for(game->spawn_credit += game->spawn_rate; game->spawn_credit >= SPAWN_SHARES; game->spawn_credit -= SPAWN_SHARES)
+	{ SpawnMonster(); }
+    }
+  
+  phase = Profile(PHASE_SPAWN, phase);
+  
+  //update the monsters, all at once
+  UpdateFlowField();
+  phase = Profile(PHASE_FLOW, phase);
+  ParallelFor(game->monsters.count, PlanMonsters);
+  phase = Profile(PHASE_PLAN, phase);
+  
+  //change the player's location, stopping it at walls, floors and ceilings
+  struct body_move move = SweepBody(player_pixel, game->player.fraction, game->player.speed, player_ref);
+  if(move.x.blocked)
+    {
+      if(game->player.speed.x < 0)
+	{ game->blocked_right = TRUE; }
+      else if(game->player.speed.x > 0)
+	{ game->blocked_left = TRUE; }
+      game->player.speed.x = 0;
+    }
+  if(move.y.blocked)
+    { game->player.speed.y = 0; }
+  PlaceAt(&game->player.location, &game->player.center, move.to, player_ref);
+  game->player.fraction = move.fraction;
+  
+  //change the monsters' locations
+  CommitMoves();
+  RemoveDead();
+  Profile(PHASE_MOVES, phase);
+  Profile(PHASE_UPDATE, started);
+}
+
+/*
+  Render the game state as of 'snap.' Frames are drawn more often than
+  the game is updated, so moving objects are drawn 'alpha' (0 to 1) of
+  the way from where they were before the tick to where they are after.
+*/
+void RenderState(SDL_Surface *screen, struct snapshot *snap, float alpha)
+{   
+  double started = ProfileStart();
+  if ( SDL_MUSTLOCK(screen) )
+    {
+      if ( SDL_LockSurface(screen) < 0 )
+	{ return; }
+    }
+  
+  struct point player_pixel = Interpolate(snap->player.from, snap->player.to, alpha);
+  UpdateCamera(player_pixel);
+  
+  struct dirty_list *last = &render_cache.drawn[render_cache.current];
+  render_cache.current ^= 1;
+  struct dirty_list *now = &render_cache.drawn[render_cache.current];
+  now->count = 0;
+  now->overflow = FALSE;
+  
+  //Put the platforms back: all of them if the view has changed,
+  //otherwise just where things moved from
+  enum boolean redrawn = RefreshBackground(screen, snap);
+  if (redrawn || last->overflow)
+    { SDL_BlitSurface(render_cache.background, NULL, screen, NULL); }
+  else
+    {
+      for(int i = 0; i < last->count; i++)
+	{
+	  SDL_Rect dest = last->rects[i];
+	  SDL_BlitSurface(render_cache.background, &last->rects[i], screen, &dest);
+	}
+    }
+  double phase = Profile(PHASE_BACKGROUND, started);
+  
+  //Draw the monsters 
+  for(int i = 0; i < snap->sprite_count; i++)
+    { ListSprite(&render_cache.draws, &snap->sprites[i], alpha); }
+  DrawList(screen, &render_cache.draws, now);
+  
+  //Draw the player 
+  DrawTortoise(screen, snap->player.icon, player_pixel, snap->player_square, now);
+  
+  if ( SDL_MUSTLOCK(screen) )
+    { SDL_UnlockSurface(screen); }
+  phase = Profile(PHASE_SPRITES, phase);
+  
+  if (game->profiler->overlay)
+    {
+      DrawProfile(screen, now);
+      phase = ProfileStart();
+    }
+  
+  //Update screen for player to see, if it's the window rather than a
+  //surface in memory (see Offscreen Rendering)
+  if (screen == SDL_GetVideoSurface())
+    {
+      if (redrawn || last->overflow || now->overflow)
+	{ SDL_UpdateRect(screen, 0, 0, WIDTH, HEIGHT); }
+      else
+	{
+	  memcpy(render_cache.present, last->rects, last->count * sizeof(SDL_Rect));
+	  memcpy(render_cache.present + last->count, now->rects, now->count * sizeof(SDL_Rect));
+	  SDL_UpdateRects(screen, last->count + now->count, render_cache.present);
+	}
+    }
+  Profile(PHASE_PRESENT, phase);
+  Profile(PHASE_RENDER, started);
+  FramePresented(snap->keys_applied);
+}
+
+//At end game, render either a "victory" screen or a "loss" screen
+void RenderFinal(SDL_Surface *screen, enum boolean victory)
+{
+  if ( SDL_MUSTLOCK(screen) )
+    {
+      if ( SDL_LockSurface(screen) < 0 )
+	{ return; }
+    }
+  
+  ClearScreen(screen, SDL_MapRGB(screen->format, 0,0,0));
+      
+  SDL_Rect dest = { 0, 0, WIDTH, HEIGHT };
+  SDL_Surface *image = victory ? assets.victory : assets.loss;
+  if ( image != NULL )
+    { SDL_BlitSurface(image, NULL, screen, &dest); }
+      
+  if ( SDL_MUSTLOCK(screen) )
+    { SDL_UnlockSurface(screen); }
+  
+  SDL_UpdateRect(screen, 0, 0, WIDTH, HEIGHT);
+  
+  //Sleep a moment so player doesn't accidentally exit before he's had the
+  //opportunity to realize the game is over.
+  sleep(1);
+  
+  //Wait for player input to exit.
+  SDL_Event event;
+  SDL_WaitEvent(&event);
+  exit(0);
+}
+
+/*
+  Key presses and releases on their way from the main thread, which
+  reads them, to the simulation, which acts on them. Only HandleEvents
+  adds to the queue and only ApplyInput takes from it.
+*/
+#define KEY_QUEUE_SIZE 256
+struct key_event
+{
+  Uint8 type;
+  SDLKey key;
+};
+
+struct key_queue
+{
+  unsigned int head;
+  unsigned int tail;
+  struct key_event events[KEY_QUEUE_SIZE];
+} key_queue;
+
+//Key presses from the player the simulation has acted on so far
+long keys_applied = 0;
+
+//Adds 'key' to the queue. Returns FALSE if it's full.
+enum boolean QueueKey(struct key_event key)
+{
+  unsigned int tail = key_queue.tail;
+  if (tail - __atomic_load_n(&key_queue.head, __ATOMIC_ACQUIRE) == KEY_QUEUE_SIZE)
+    { return FALSE; }
+  key_queue.events[tail % KEY_QUEUE_SIZE] = key;
+  __atomic_store_n(&key_queue.tail, tail + 1, __ATOMIC_RELEASE);
+  return TRUE;
+}
+
+void QuickSave();
+void QuickLoad();
+void RewindBack();
+
+//Acts on a key press or release
+void ApplyKey(struct key_event key)
+{
+  switch (key.type)
+    {
+    case SDL_KEYDOWN:
+      switch (key.key)
+	{
+	  //Left and Right keys cause the user to accelerate respectively
+	  //Up key jumps.
+	case SDLK_UP:
+	  if(PlayerResting())
+	    {
+	      game->player.speed.y = JUMP_SPEED;
+	      PlaySound(SOUND_JUMP);
+	    }
+	  break;
+	case SDLK_DOWN:
+	  if(PlayerResting())
+	    { game->player.speed.y = -JUMP_SPEED; }
+	  break;
+	case SDLK_RIGHT:
+	  game->player.speed.x += RUN_STEP;
+	  break;
+	case SDLK_LEFT:
+	  game->player.speed.x -= RUN_STEP;
+	  break;
+	  
+	  //F5 saves, F9 goes back to the save and Backspace rewinds
+	case SDLK_F5:
+	  QuickSave();
+	  break;
+	case SDLK_F9:
+	  QuickLoad();
+	  break;
+	case SDLK_BACKSPACE:
+	  RewindBack();
+	  break;
+	case SDLK_UNKNOWN:
+	  break;
+	default:
+	  break;
+	}
+      break;
+    case SDL_KEYUP:
+      switch (key.key)
+	{
+	  //Releasing the left and right keys cause the player to accelerate
+	  //in the opposite direction (to counteract the initial acceleration)
+	  //unless the player has already been stopped by a wall.
+	case SDLK_UP:
+	  break;
+	case SDLK_DOWN:
+	  break;
+	case SDLK_RIGHT:
+	  if(game->blocked_left)
+	    { game->blocked_left= FALSE; }
+	  else
+	    { game->player.speed.x -= RUN_STEP; }
+	  break;
+	case SDLK_LEFT:
+	  if(game->blocked_right)
+	    { game->blocked_right= FALSE; }
+	  else
+	    { game->player.speed.x += RUN_STEP; }
+	  break;
+	case SDLK_UNKNOWN:
+	  break;
+	default:
+	  break;
+	}
+      break;
+    }
+}
+
+void RecordKey(struct key_event key);
+
+//Acts on all the keys queued since the last tick
+void ApplyInput()
+{
+  unsigned int head = key_queue.head;
+  unsigned int tail = __atomic_load_n(&key_queue.tail, __ATOMIC_ACQUIRE);
+  for(; head != tail; head++)
+    {
+      struct key_event key = key_queue.events[head % KEY_QUEUE_SIZE];
+      if (key.type == SDL_KEYDOWN)
+	{ keys_applied++; }
+      RecordKey(key);
+      ApplyKey(key);
+    }
+  __atomic_store_n(&key_queue.head, head, __ATOMIC_RELEASE);
+}
+
+//Handle user input, passing keys on to the simulation
+void HandleEvents()
+{
+  SDL_Event event;
+
+  while(SDL_PollEvent(&event))
+    {
+      switch (event.type)
+	{
+	case SDL_KEYDOWN:
+	case SDL_KEYUP:
+	  {
+	    //F3 shows the profile; it's not part of the game
+	    if (event.key.keysym.sym == SDLK_F3)
+	      {
+		if (event.type == SDL_KEYDOWN)
+		  { ToggleOverlay(); }
+		break;
+	      }
+	    struct key_event key = {event.type, event.key.keysym.sym};
+	    if (QueueKey(key) && event.type == SDL_KEYDOWN)
+	      { KeyPressed(); }
+	  }
+	  break;
+	case SDL_QUIT:
+	  exit(0);
+	}
+    }
+}
+
+/*********************************************************\
+                         Save States
+\*********************************************************/
+
+/*
+  A save state is everything that changes as the game is played,
+  written out as bytes: the player, the monster store (with handles
+  and grid links, which are indices rather than pointers), the corpse
+  list and the spawners with their timer wheel. The grid itself is
+  rebuilt from the links, and the flow field from scratch. Platforms
+  and the parts of the map read in aren't included, since they only
+  ever grow and are the same whenever they're read.
+
+  States are for this run of the program only: numbers are written as
+  they are in memory.
+
+  The monsters' fields are written one after another, each a block of
+  its own, padded to a whole number of words, so that from one tick to
+  the next most of a state is the same bytes in the same places.
+  That's what the rewind buffer relies on to keep frames small.
+*/
+
+//Appends 'size' bytes from 'data' at '*at.'
+void Put(Uint8 **at, const void *data, size_t size)
+{
+  memcpy(*at, data, size);
+  *at += size;
+}
+
+//Reads 'size' bytes at '*at' into 'data.'
+void Get(const Uint8 **at, void *data, size_t size)
+{
+  memcpy(data, *at, size);
+  *at += size;
+}
+
+//Returns how many bytes a save state takes with 'monsters' monsters
+//and the first 'slots' slots of their store touched.
+long StateSizeFor(long monsters, long slots)
+{
+  long monster_bytes = sizeof(struct point) * 4 + sizeof(struct vector) +
+    sizeof(enum boolean) + sizeof(Uint8) + sizeof(long) + sizeof(Uint32);
+  long slot_bytes = sizeof(struct square_links) + 2 * sizeof(Uint32);
+  long spawner_bytes = 3 * sizeof(int) + 2 * sizeof(long);
+  return 16 * sizeof(long) + 4 + sizeof(unsigned int) + sizeof(int) + 2 * (sizeof(long) + sizeof(int)) +
+    sizeof(struct object) + sizeof(struct square_links) +
+    sizeof(struct corpse_list) + sizeof(struct timer_wheel) +
+    monsters * monster_bytes + slots * slot_bytes +
+    game->spawners->count * spawner_bytes;
+}
+
+//Returns how many bytes a save state of the game as it is takes.
+long StateSize()
+{ return StateSizeFor(game->monsters.count, game->monsters.slots_touched); }
+
+//Writes a save state into 'buffer,' which must have room for
+//StateSize() bytes. Returns the bytes written.
+long SaveState(Uint8 *buffer)
+{
+  Uint8 *at = buffer;
+  struct entity_store *store = &game->monsters;
+  
+  Put(&at, &game->player.location, sizeof(struct point));
+  Put(&at, &game->player.center, sizeof(struct point));
+  Put(&at, &game->player.fraction, sizeof(struct point));
+  Put(&at, &game->player.speed, sizeof(struct vector));
+  Put(&at, &game->player.alive, sizeof(enum boolean));
+  Put(&at, &game->player.previous, sizeof(struct point));
+  Put(&at, &game->player_links, sizeof(struct square_links));
+  Put(&at, &game->blocked_left, sizeof(enum boolean));
+  Put(&at, &game->blocked_right, sizeof(enum boolean));
+  Put(&at, &game->corpses, sizeof(struct corpse_list));
+  Put(&at, &game->animation_clock, sizeof(long));
+  Put(&at, &game->seed, sizeof(unsigned int));
+  Put(&at, &game->spawn_credit, sizeof(int));
+  Put(&at, game->corner_due, sizeof(game->corner_due));
+  Put(&at, game->corner_wait, sizeof(game->corner_wait));
+  
+  Put(&at, &store->count, sizeof(int));
+  Put(&at, &store->free_slot, sizeof(int));
+  Put(&at, &store->slots_touched, sizeof(int));
+  Put(&at, store->location, store->count * sizeof(struct point));
+  Put(&at, store->center, store->count * sizeof(struct point));
+  Put(&at, store->fraction, store->count * sizeof(struct point));
+  Put(&at, store->speed, store->count * sizeof(struct vector));
+  Put(&at, store->alive, store->count * sizeof(enum boolean));
+  Put(&at, store->previous, store->count * sizeof(struct point));
+  Put(&at, store->animation_start, store->count * sizeof(long));
+  Put(&at, store->animation, store->count * sizeof(Uint8));
+  for(; (at - buffer) % 4 != 0; at++)
+    { *at = 0; }
+  Put(&at, store->id, store->count * sizeof(Uint32));
+  Put(&at, store->links, store->slots_touched * sizeof(struct square_links));
+  Put(&at, store->slot_index, store->slots_touched * sizeof(Uint32));
+  Put(&at, store->slot_generation, store->slots_touched * sizeof(Uint32));
+  
+  Put(&at, &game->spawners->count, sizeof(int));
+  Put(&at, game->wheel, sizeof(struct timer_wheel));
+  for(int i = 0; i < game->spawners->count; i++)
+    {
+      struct spawner *spawner = &game->spawners->spawner[i];
+      Put(&at, &spawner->left, sizeof(int));
+      Put(&at, &spawner->started, sizeof(long));
+      Put(&at, &spawner->wait, sizeof(int));
+      Put(&at, &spawner->due, sizeof(long));
+      Put(&at, &spawner->next, sizeof(int));
+    }
+  return at - buffer;
+}
+
+//Returns TRUE if 'ref' is the player or a monster, which save states
+//hold, rather than a platform or nothing.
+enum boolean Moves(struct entity_ref ref)
+{ return ref.type == PLAYER || ref.type == MONSTER; }
+
+/*
+  Puts back in the grid a run of things that move which follow one
+  another in a square, as the links saved with them say, starting with
+  'first.' The run goes back after the platform the state had before it,
+  or first in the square; whatever is in the square now, such as
+  platforms read in since the state was saved, follows on after it.
+  The links are all set afresh, so none is left pointing at something
+  that's no longer there.
+*/
+void RelinkRun(struct entity_ref first)
+{
+  struct entity_ref after = LinksOf(first)->prev;
+  for(struct entity_ref ref = first; Moves(ref); )
+    {
+      struct entity_ref next = LinksOf(ref)->next;
+      struct point at = game->player.location;
+      if (ref.type == MONSTER)
+	{ at = game->monsters.location[LookupObject(&game->monsters, ref.id)]; }
+      if (after.type == NOTHING)
+	{ AddToCell(at.x, at.y, ref); }
+      else
+	{ InsertAfter(after, ref); }
+      after = ref;
+      ref = next;
+    }
+}
+
+//Puts the game back as it was when 'buffer' was written by SaveState.
+//The state has to be from the world that's loaded now.
+void LoadState(const Uint8 *buffer)
+{
+  const Uint8 *at = buffer;
+  struct entity_store *store = &game->monsters;
+  
+  //Take everything that moves out of the grid
+  struct entity_ref player_ref = {PLAYER, NO_HANDLE};
+  RemoveFromCell(game->player.location.x, game->player.location.y, player_ref);
+  for(int i = 0; i < store->count; i++)
+    {
+      struct entity_ref ref = {MONSTER, store->id[i]};
+      if (store->alive[i])
+	{ RemoveFromCell(store->location[i].x, store->location[i].y, ref); }
+    }
+  
+  int touched = store->slots_touched;
+  Get(&at, &game->player.location, sizeof(struct point));
+  Get(&at, &game->player.center, sizeof(struct point));
+  Get(&at, &game->player.fraction, sizeof(struct point));
+  Get(&at, &game->player.speed, sizeof(struct vector));
+  Get(&at, &game->player.alive, sizeof(enum boolean));
+  Get(&at, &game->player.previous, sizeof(struct point));
+  Get(&at, &game->player_links, sizeof(struct square_links));
+  Get(&at, &game->blocked_left, sizeof(enum boolean));
+  Get(&at, &game->blocked_right, sizeof(enum boolean));
+  Get(&at, &game->corpses, sizeof(struct corpse_list));
+  Get(&at, &game->animation_clock, sizeof(long));
+  Get(&at, &game->seed, sizeof(unsigned int));
+  Get(&at, &game->spawn_credit, sizeof(int));
+  Get(&at, game->corner_due, sizeof(game->corner_due));
+  Get(&at, game->corner_wait, sizeof(game->corner_wait));
+  
+  Get(&at, &store->count, sizeof(int));
+  Get(&at, &store->free_slot, sizeof(int));
+  Get(&at, &store->slots_touched, sizeof(int));
+  Get(&at, store->location, store->count * sizeof(struct point));
+  Get(&at, store->center, store->count * sizeof(struct point));
+  Get(&at, store->fraction, store->count * sizeof(struct point));
+  Get(&at, store->speed, store->count * sizeof(struct vector));
+  Get(&at, store->alive, store->count * sizeof(enum boolean));
+  Get(&at, store->previous, store->count * sizeof(struct point));
+  Get(&at, store->animation_start, store->count * sizeof(long));
+  Get(&at, store->animation, store->count * sizeof(Uint8));
+  at += (4 - (at - buffer) % 4) % 4;
+  Get(&at, store->id, store->count * sizeof(Uint32));
+  Get(&at, store->links, store->slots_touched * sizeof(struct square_links));
+  Get(&at, store->slot_index, store->slots_touched * sizeof(Uint32));
+  Get(&at, store->slot_generation, store->slots_touched * sizeof(Uint32));
+  
+  //Slots used since the state was saved go back to never having been
+  for(int slot = store->slots_touched; slot < touched; slot++)
+    {
+      store->slot_generation[slot] = 1;
+      store->slot_index[slot] = slot + 1;
+    }
+  if (touched == store->capacity && store->slots_touched < touched)
+    { store->slot_index[touched - 1] = -1; }
+  for(int i = 0; i < store->count; i++)
+    {
+      store->icon[i] = &monster_icon;
+      store->type[i] = MONSTER;
+    }
+  
+  int count;
+  Get(&at, &count, sizeof(int));
+  Get(&at, game->wheel, sizeof(struct timer_wheel));
+  for(int i = 0; i < count && i < game->spawners->count; i++)
+    {
+      struct spawner *spawner = &game->spawners->spawner[i];
+      Get(&at, &spawner->left, sizeof(int));
+      Get(&at, &spawner->started, sizeof(long));
+      Get(&at, &spawner->wait, sizeof(int));
+      Get(&at, &spawner->due, sizeof(long));
+      Get(&at, &spawner->next, sizeof(int));
+    }
+  
+  //Put everything that moves back in the grid, in the order the saved
+  //links give, starting from the first of each run of them in a square
+  if (!Moves(game->player_links.prev))
+    { RelinkRun(player_ref); }
+  for(int i = 0; i < store->count; i++)
+    {
+      struct entity_ref ref = {MONSTER, store->id[i]};
+      if (store->alive[i] && !Moves(store->links[store->id[i] & SLOT_MASK].prev))
+	{ RelinkRun(ref); }
+    }
+  game->flow->built = FALSE;
+}
+
+/*
+  The rewind buffer keeps a save state for each of the last
+  REWIND_SECONDS of ticks. Every KEYFRAME_TICKS ticks the state is kept
+  whole, as a keyframe; the ticks between keep only how they differ
+  from their keyframe: the two are XORed together and the runs of
+  zeros that leaves (everything that didn't change) are squeezed out.
+  Any tick can then be had back with one keyframe and one set of
+  differences, however far back it is.
+
+  The frames go one after another round a fixed block of memory. When
+  it's full, the oldest keyframe goes, and the frames that depend on it
+  with it. The memory is sized when a world is loaded, for the most
+  monsters its open squares can hold (see LargestState), and grows in
+  the rare case a state turns out bigger, so a state is never too big
+  to keep.
+
+  States are compared 4 bytes at a time, a word being the size of most
+  of what's in them. A difference is a run of counts, each written 7
+  bits a byte as in replays: unchanged words, then changed words
+  followed by the changes themselves, and so on to the end of the
+  state.
+*/
+#define REWIND_SECONDS 10
+#define REWIND_FRAMES  (REWIND_SECONDS * TICKS_PER_SECOND)
+#define KEYFRAME_TICKS TICKS_PER_SECOND
+
+//The least memory kept for frames; there's always room for two of the
+//largest states as well
+#define REWIND_BYTES   (16 << 20)
+
+//How far back a press of the rewind key goes
+#define REWIND_STEP    (2 * TICKS_PER_SECOND)
+
+struct rewind_frame
+{
+  long offset;
+  long size;
+  
+  //The size of the state it holds, and its keyframe (itself, if it is one)
+  long state_size;
+  int keyframe;
+};
+
+struct rewind_buffer
+{
+  Uint8 *memory;
+  long memory_bytes;
+  long write;
+  
+  //A ring of frames, oldest first
+  struct rewind_frame frames[REWIND_FRAMES];
+  int oldest;
+  int count;
+  
+  //The state being saved or put back, and the differences being made;
+  //'state' has room for 'state_bytes,' and 'packed' for half that
+  Uint8 *state;
+  Uint8 *packed;
+  long state_bytes;
+  
+  //The quick save slot, and the size of the state in it (0 if none)
+  Uint8 *saved;
+  long saved_size;
+  
+  //For the benchmark: frames and bytes kept, and time taken
+  long keyframes;
+  long keyframe_bytes;
+  long deltas;
+  long delta_bytes;
+  double seconds;
+};
+
+//Forgets every frame.
+void ClearRewind()
+{
+  game->rewind->oldest = 0;
+  game->rewind->count = 0;
+  game->rewind->write = 0;
+}
+
+//Forgets every frame and the quick save, for a new world. Games made
+//without a rewind buffer (see InitGame) have none to clear.
+void ClearSaveStates()
+{
+  if (game->rewind == NULL)
+    { return; }
+  ClearRewind();
+  game->rewind->saved_size = 0;
+}
+
+/*
+  Bodies can't overlap platforms or each other, and a body is nearly a
+  square across, so the open squares of a world hold fewer than
+  BODIES_PER_SQUARE of them each. The dead fall through everything but
+  are few: those the player kills are listed in 'corpses,' and the rest
+  are removed as they die.
+*/
+#define BODIES_PER_SQUARE 2
+
+//Returns the most bytes a save state of the world just loaded should
+//take: its open squares full of monsters, or the monster store full if
+//that's fewer.
+long LargestState()
+{
+  long open = (long)game->world.width * game->world.height - game->world.block_count;
+  long monsters = open * BODIES_PER_SQUARE + MAX_CORPSES;
+  if (monsters > game->max_monsters)
+    { monsters = game->max_monsters; }
+  return StateSizeFor(monsters, monsters);
+}
+
+//Makes the buffers for states at least 'size' bytes, and the rewind
+//memory room for two of them or REWIND_BYTES, whichever is more. What
+//they hold is kept: frames stay where they were in the memory, which
+//just goes on further.
+void GrowSaveStates(long size)
+{
+  struct rewind_buffer *rewind = game->rewind;
+  if (size > rewind->state_bytes)
+    {
+      Uint8 *saved = Allocate(size);
+      if (rewind->saved_size > 0)
+	{ memcpy(saved, rewind->saved, rewind->saved_size); }
+      Release(rewind->state);
+      Release(rewind->packed);
+      Release(rewind->saved);
+      rewind->state = Allocate(size);
+      rewind->packed = Allocate(size / 2);
+      rewind->saved = saved;
+      rewind->state_bytes = size;
+    }
+  long memory = (2 * size > REWIND_BYTES) ? 2 * size : REWIND_BYTES;
+  if (memory > rewind->memory_bytes)
+    {
+      Uint8 *grown = Allocate(memory);
+      if (rewind->memory != NULL)
+	{ memcpy(grown, rewind->memory, rewind->memory_bytes); }
+      Release(rewind->memory);
+      rewind->memory = grown;
+      rewind->memory_bytes = memory;
+    }
+}
+
+//Sizes the rewind buffer and the quick save slot for the world just
+//loaded (see LargestState), after ClearSaveStates. The memory is kept
+//for later worlds that fit.
+void SizeSaveStates()
+{
+  if (game->rewind != NULL)
+    { GrowSaveStates(LargestState()); }
+}
+
+//Makes room for a state of the game as it is, should it have outgrown
+//LargestState after all; the buffers then double, so it's seldom.
+//Returns the size of the state.
+long RoomForState()
+{
+  long size = StateSize();
+  if (size > game->rewind->state_bytes)
+    { GrowSaveStates(2 * size); }
+  return size;
+}
+
+struct rewind_frame *RewindFrame(int n)
+{ return &game->rewind->frames[(game->rewind->oldest + n) % REWIND_FRAMES]; }
+
+//Drops the oldest keyframe and the frames that depend on it.
+void DropOldest()
+{
+  do
+    {
+      game->rewind->oldest = (game->rewind->oldest + 1) % REWIND_FRAMES;
+      game->rewind->count--;
+    }
+  while(game->rewind->count > 0 && RewindFrame(0)->keyframe != game->rewind->oldest);
+}
+
+//Finds 'size' bytes in the buffer's memory for a new frame, dropping
+//old frames if need be. Returns the offset.
+long MakeRoom(long size)
+{
+  long offset = game->rewind->write;
+  if (offset + size > game->rewind->memory_bytes)
+    {
+      //Going back to the start leaves behind the frames after the
+      //write position, which are the oldest
+      while(game->rewind->count > 0 && RewindFrame(0)->offset >= offset)
+	{ DropOldest(); }
+      offset = 0;
+    }
+  while(game->rewind->count > 0)
+    {
+      struct rewind_frame *oldest = RewindFrame(0);
+      enum boolean overlaps = oldest->offset < offset + size && offset < oldest->offset + oldest->size;
+      if (!overlaps && game->rewind->count < REWIND_FRAMES)
+	{ break; }
+      DropOldest();
+    }
+  game->rewind->write = offset + size;
+  return offset;
+}
+
+//Reads word 'i' of a state, wherever it is in memory.
+Uint32 WordAt(const Uint8 *bytes, long i)
+{
+  Uint32 word;
+  memcpy(&word, bytes + 4 * i, 4);
+  return word;
+}
+
+void PackCount(Uint8 **at, unsigned long count)
+{
+  for(; count >= 0x80; count >>= 7)
+    { *(*at)++ = (count & 0x7F) | 0x80; }
+  *(*at)++ = count;
+}
+
+unsigned long UnpackCount(const Uint8 **at)
+{
+  unsigned long count = 0;
+  for(int shift = 0; ; shift += 7)
+    {
+      Uint8 byte = *(*at)++;
+      count |= (unsigned long)(byte & 0x7F) << shift;
+      if (!(byte & 0x80))
+	{ return count; }
+    }
+}
+
+//XORs 'state' with 'key' and packs the result into 'packed.' Returns
+//the packed size, or -1 if it would be more than 'limit' bytes.
+long PackDifferences(const Uint8 *state, long size, const Uint8 *key, long key_size,
+		     Uint8 *packed, long limit)
+{
+  Uint8 *at = packed;
+  long words = size / 4, key_words = key_size / 4;
+  long i = 0;
+  while(i < words)
+    {
+      long start = i;
+      while(i < words && i < key_words && WordAt(state, i) == WordAt(key, i))
+	{ i++; }
+      if (at - packed + 20 > limit)
+	{ return -1; }
+      PackCount(&at, i - start);
+      
+      start = i;
+      while(i < words && (i >= key_words || WordAt(state, i) != WordAt(key, i)))
+	{ i++; }
+      PackCount(&at, i - start);
+      if (at - packed + 4 * (i - start) > limit)
+	{ return -1; }
+      for(long j = start; j < i; j++)
+	{
+	  Uint32 word = WordAt(state, j) ^ (j < key_words ? WordAt(key, j) : 0);
+	  memcpy(at, &word, 4);
+	  at += 4;
+	}
+    }
+  return at - packed;
+}
+
+//Undoes PackDifferences, writing the state into 'state.'
+void UnpackDifferences(const Uint8 *packed, long packed_size, const Uint8 *key, long key_size,
+		       Uint8 *state, long size)
+{
+  const Uint8 *at = packed, *end = packed + packed_size;
+  long i = 0;
+  memcpy(state, key, size < key_size ? size : key_size);
+  if (size > key_size)
+    { memset(state + key_size, 0, size - key_size); }
+  while(at < end)
+    {
+      i += UnpackCount(&at);
+      for(long changed = UnpackCount(&at); changed > 0; changed--, i++, at += 4)
+	{
+	  Uint32 word = WordAt(state, i) ^ WordAt(at, 0);
+	  memcpy(state + 4 * i, &word, 4);
+	}
+    }
+}
+
+//Adds a frame for the tick just played.
+void CaptureRewind()
+{
+  double start = Now();
+  RoomForState();
+  long size = SaveState(game->rewind->state);
+  
+  //Keep only the differences from the last keyframe, unless it's time
+  //for a new one or they wouldn't be much smaller
+  int keyframe = -1;
+  long packed_size = 0;
+  if (game->rewind->count > 0)
+    {
+      int last = (game->rewind->oldest + game->rewind->count - 1) % REWIND_FRAMES;
+      keyframe = game->rewind->frames[last].keyframe;
+      struct rewind_frame *key = &game->rewind->frames[keyframe];
+      if ((last - keyframe + REWIND_FRAMES) % REWIND_FRAMES + 1 < KEYFRAME_TICKS)
+	{
+	  packed_size = PackDifferences(game->rewind->state, size, game->rewind->memory + key->offset,
+					key->state_size, game->rewind->packed, size / 2);
+	}
+      if (packed_size <= 0)
+	{ keyframe = -1; }
+    }
+  
+  struct rewind_frame frame;
+  frame.state_size = size;
+  frame.size = (keyframe >= 0) ? packed_size : size;
+  frame.offset = MakeRoom(frame.size);
+  if (keyframe >= 0 && game->rewind->count == 0)
+    {
+      //Frames are dropped oldest first, so if making room dropped the
+      //keyframe it dropped every frame, and this has to be one instead.
+      //The buffer is empty, so the room made is given back first.
+      keyframe = -1;
+      ClearRewind();
+      frame.size = size;
+      frame.offset = MakeRoom(size);
+    }
+  if (keyframe >= 0)
+    {
+      frame.keyframe = keyframe;
+      memcpy(game->rewind->memory + frame.offset, game->rewind->packed, packed_size);
+    }
+  else
+    {
+      frame.keyframe = (game->rewind->oldest + game->rewind->count) % REWIND_FRAMES;
+      memcpy(game->rewind->memory + frame.offset, game->rewind->state, size);
+    }
+  *RewindFrame(game->rewind->count++) = frame;
+  
+  if (keyframe >= 0)
+    {
+      game->rewind->deltas++;
+      game->rewind->delta_bytes += frame.size;
+    }
+  else
+    {
+      game->rewind->keyframes++;
+      game->rewind->keyframe_bytes += frame.size;
+    }
+  game->rewind->seconds += Now() - start;
+}
+
+//Puts back the state of frame 'n' (counting from the oldest).
+void RestoreFrame(int n)
+{
+  struct rewind_frame *frame = RewindFrame(n);
+  struct rewind_frame *key = &game->rewind->frames[frame->keyframe];
+  const Uint8 *stored = game->rewind->memory + frame->offset;
+  if (frame != key)
+    {
+      UnpackDifferences(stored, frame->size, game->rewind->memory + key->offset, key->state_size,
+			game->rewind->state, frame->state_size);
+      stored = game->rewind->state;
+    }
+  LoadState(stored);
+}
+
+//Goes back REWIND_STEP ticks, or as far as the buffer goes, and
+//forgets the frames after that.
+void RewindBack()
+{
+  if (game->rewind->count == 0)
+    { return; }
+  int n = game->rewind->count - 1 - REWIND_STEP;
+  if (n < 0)
+    { n = 0; }
+  RestoreFrame(n);
+  game->rewind->count = n + 1;
+  game->rewind->write = RewindFrame(n)->offset + RewindFrame(n)->size;
+}
+
+//Keeps the game as it is in the quick save slot.
+void QuickSave()
+{
+  RoomForState();
+  game->rewind->saved_size = SaveState(game->rewind->saved);
+}
+
+//Goes back to the quick save, if there is one.
+void QuickLoad()
+{
+  if (game->rewind->saved_size == 0)
+    { return; }
+  LoadState(game->rewind->saved);
+  ClearRewind();
+}
+
+/*********************************************************\
+                          Replays
+\*********************************************************/
+
+/*
+  With everything else driven by the tick count, a game is decided by
+  the random seed, the map and which keys were acted on at which tick,
+  so that is all a replay records. The file is:
+
+    "HWR1", the seed (4 bytes, least significant first), the length of
+    the map's path (2 bytes) and the path, and then a record for each
+    key: the ticks since the last record, 7 bits a byte with the top
+    bit set on all but the last byte, then a byte for the key (its
+    index in replay_keys, plus REPLAY_DOWN for a press). A last record
+    with the key REPLAY_END marks the tick the game stopped on.
+
+  Keys the game doesn't act on aren't recorded.
+*/
+#define REPLAY_DOWN 0x80
+#define REPLAY_END  0xFF
+
+//Replays are checked through before they're played: a count can take
+//at most REPLAY_COUNT_BYTES bytes, and a replay can't run past
+//REPLAY_MAX_TICKS (a day of play)
+#define REPLAY_COUNT_BYTES 9
+#define REPLAY_MAX_TICKS   (TICKS_PER_SECOND * 60L * 60 * 24)
+
+SDLKey replay_keys[] = {SDLK_LEFT, SDLK_RIGHT, SDLK_UP, SDLK_DOWN, SDLK_F5, SDLK_F9, SDLK_BACKSPACE};
+#define REPLAY_KEYS (int)(sizeof(replay_keys) / sizeof(replay_keys[0]))
+
+struct replay
+{
+  //Ticks the game has been played for
+  long tick;
+  
+  //Recording: where to, and the tick of the last record
+  FILE *out;
+  long recorded;
+  
+  //Playing back: the file's contents, how far through them it is, and
+  //the next record
+  Uint8 *data;
+  long size;
+  long read;
+  long next_tick;
+  int next_key;
+  int finished;
+  
+  unsigned int seed;
+  char map[256];
+};
+
+Uint32 WorldChecksum();
+
+void WriteCount(FILE *out, unsigned long count)
+{
+  for(; count >= 0x80; count >>= 7)
+    { fputc((count & 0x7F) | 0x80, out); }
+  fputc(count, out);
+}
+
+//Starts recording the game to 'path,' to be played with 'seed.'
+void StartRecording(const char *path, unsigned int seed)
+{
+  game->replay->out = fopen(path, "wb");
+  if (game->replay->out == NULL)
+    {
+      fprintf(stderr, "Couldn't write replay %s\n", path);
+      exit(1);
+    }
+  size_t length = strlen(map_file);
+  fputs("HWR1", game->replay->out);
+  for(int i = 0; i < 4; i++)
+    { fputc(seed >> (8 * i), game->replay->out); }
+  fputc(length & 0xFF, game->replay->out);
+  fputc(length >> 8, game->replay->out);
+  fwrite(map_file, 1, length, game->replay->out);
+}
+
+void WriteRecord(int key)
+{
+  WriteCount(game->replay->out, game->replay->tick - game->replay->recorded);
+  fputc(key, game->replay->out);
+  game->replay->recorded = game->replay->tick;
+}
+
+//Notes down 'key' as acted on this tick, if recording.
+void RecordKey(struct key_event key)
+{
+  if (game->replay->out == NULL)
+    { return; }
+  for(int i = 0; i < REPLAY_KEYS; i++)
+    {
+      if (replay_keys[i] == key.key)
+	{ WriteRecord(i | (key.type == SDL_KEYDOWN ? REPLAY_DOWN : 0)); }
+    }
+}
+
+//Marks the end of the recording and closes it. Prints the state the
+//game ended in, so a playback can be checked against it.
+void FinishRecording()
+{
+  if (game->replay->out == NULL)
+    { return; }
+  WriteRecord(REPLAY_END);
+  fclose(game->replay->out);
+  game->replay->out = NULL;
+  printf("recorded %ld ticks, final state checksum %08x\n", game->replay->tick, WorldChecksum());
+}
+
+//Reads a count written by WriteCount. Returns -1 if the file runs out
+//first, or the count is longer or larger than a replay's can be.
+long ReadCount()
+{
+  Uint64 count = 0;
+  for(int shift = 0; shift < 7 * REPLAY_COUNT_BYTES && game->replay->read < game->replay->size; shift += 7)
+    {
+      Uint8 byte = game->replay->data[game->replay->read++];
+      count |= (Uint64)(byte & 0x7F) << shift;
+      if (!(byte & 0x80))
+	{ return (count > REPLAY_MAX_TICKS) ? -1 : (long)count; }
+    }
+  return -1;
+}
+
+//Reads the next record. Returns FALSE if the file runs out first or
+//the record can't be right.
+enum boolean ReadRecord()
+{
+  long ticks = ReadCount();
+  if (ticks < 0 || game->replay->read == game->replay->size)
+    { return FALSE; }
+  game->replay->next_tick += ticks;
+  game->replay->next_key = game->replay->data[game->replay->read++];
+  return (game->replay->next_tick <= REPLAY_MAX_TICKS &&
+	  (game->replay->next_key == REPLAY_END || (game->replay->next_key & ~REPLAY_DOWN) < REPLAY_KEYS));
+}
+
+//Reads in the replay at 'path' to play back, and plays on its map.
+void OpenReplay(const char *path)
+{
+  FILE *in = fopen(path, "rb");
+  if (in == NULL)
+    {
+      fprintf(stderr, "Couldn't open replay %s\n", path);
+      exit(1);
+    }
+  fseek(in, 0, SEEK_END);
+  game->replay->size = ftell(in);
+  rewind(in);
+  game->replay->data = Allocate(game->replay->size);
+  if (fread(game->replay->data, 1, game->replay->size, in) != (size_t)game->replay->size)
+    { game->replay->size = 0; }
+  fclose(in);
+  
+  Uint8 *data = game->replay->data;
+  int length = game->replay->size >= 10 ? data[8] | data[9] << 8 : 0;
+  if (game->replay->size < 10 + length || length >= (int)sizeof(game->replay->map) || memcmp(data, "HWR1", 4) != 0)
+    {
+      fprintf(stderr, "%s isn't a replay\n", path);
+      exit(1);
+    }
+  game->replay->seed = data[4] | data[5] << 8 | data[6] << 16 | (unsigned int)data[7] << 24;
+  memcpy(game->replay->map, data + 10, length);
+  game->replay->map[length] = '\0';
+  map_file = game->replay->map;
+  
+  //Go through every record before playing any, so a damaged or cut
+  //short replay is turned away rather than played to a wrong end
+  game->replay->read = 10 + length;
+  do
+    {
+      if (!ReadRecord())
+	{
+	  fprintf(stderr, "Replay %s is damaged or cut short at byte %ld\n", path, game->replay->read);
+	  exit(1);
+	}
+    }
+  while(game->replay->next_key != REPLAY_END);
+  game->replay->read = 10 + length;
+  game->replay->next_tick = 0;
+  ReadRecord();
+}
+
+//Acts on the keys recorded for this tick.
+void PlayKeys()
+{
+  for(; game->replay->next_tick == game->replay->tick && game->replay->next_key != REPLAY_END; ReadRecord())
+    {
+      struct key_event key = {(game->replay->next_key & REPLAY_DOWN) ? SDL_KEYDOWN : SDL_KEYUP,
+			      replay_keys[game->replay->next_key & ~REPLAY_DOWN]};
+      ApplyKey(key);
+    }
+}
+
+/*
+  Plays one tick of the game: the keys for it (from the player, or the
+  replay being played back), and then the update, unless the game is
+  over. Marks the replay finished once a replay has got as far as the
+  recording did.
+*/
+void PlayTick()
+{
+  if (game->replay->data != NULL)
+    { PlayKeys(); }
+  else
+    { ApplyInput(); }
+  if (game->player.alive && game->monsters.count > 0)
+    {
+      UpdateState();
+      double started = ProfileStart();
+      CaptureRewind();
+      Profile(PHASE_REWIND, started);
+      frame_stats.ticks++;
+    }
+  else
+    { SavePositions(); }
+  game->replay->tick++;
+  
+  if (game->replay->data != NULL && game->replay->next_key == REPLAY_END && game->replay->tick >= game->replay->next_tick)
+    { __atomic_store_n(&game->replay->finished, 1, __ATOMIC_RELEASE); }
+}
+
+/*********************************************************\
+                     Simulation Thread
+\*********************************************************/
+
+SDL_Thread *simulation = NULL;
+int stop_simulation = 0;
+
+//Fills in a snapshot of the world as of the tick due at 'due' and
+//hands it to the renderer.
+void PublishSnapshot(double due)
+{
+  struct snapshot *snap = SnapshotToWrite();
+  TakeSnapshot(snap);
+  snap->time = due;
+  snap->keys_applied = keys_applied;
+  FinishSnapshot();
+}
+
+//Runs the game TICKS_PER_SECOND times a second until told to stop,
+//publishing a snapshot after every tick.
+int Simulate(void *unused)
+{
+  (void)unused;
+  double due = Now();
+  while(!__atomic_load_n(&stop_simulation, __ATOMIC_ACQUIRE) &&
+	!__atomic_load_n(&game->replay->finished, __ATOMIC_ACQUIRE))
+    {
+      PlayTick();
+      double started = ProfileStart();
+      PublishSnapshot(due);
+      Profile(PHASE_SNAPSHOT, started);
+      
+      //After a long stall, don't try to make it all up at once
+      due += TICK_SECONDS;
+      if (Now() - due > MAX_CATCH_UP)
+	{ due = Now(); }
+      SleepUntil(due);
+    }
+  return 0;
+}
+
+//Starts the simulation thread, with a first snapshot ready to draw.
+void StartSimulation()
+{
+  PublishSnapshot(Now());
+  simulation = SDL_CreateThread(Simulate, NULL);
+  if (simulation == NULL)
+    {
+      fprintf(stderr, "Couldn't start the simulation: %s\n", SDL_GetError());
+      exit(1);
+    }
+}
+
+//Stops the simulation thread and waits for it to finish its tick.
+//(Called at exit, which may be from the simulation thread itself)
+void StopSimulation()
+{
+  if (simulation == NULL || SDL_ThreadID() == SDL_GetThreadID(simulation))
+    { return; }
+  __atomic_store_n(&stop_simulation, 1, __ATOMIC_RELEASE);
+  SDL_WaitThread(simulation, NULL);
+  simulation = NULL;
+}
+
+/*********************************************************\
+                           Games
+\*********************************************************/
+
+/*
+  Sets up 'g' as a game with no world loaded yet, with room for
+  'max_monsters' monsters and, if 'rewind' is set, a rewind buffer for
+  save states. Leaves the calling thread working on it.
+*/
+void InitGame(struct game *g, int max_monsters, enum boolean rewind)
+{
+  memset(g, 0, sizeof(struct game));
+  game = g;
+  g->player.icon = &player_icon;
+  g->player.type = PLAYER;
+  g->max_monsters = max_monsters;
+  g->wheel = Allocate(sizeof(struct timer_wheel));
+  g->spawners = Allocate(sizeof(struct spawner_list));
+  memset(g->spawners, 0, sizeof(struct spawner_list));
+  g->flow = Allocate(sizeof(struct flow_field));
+  g->profiler = Allocate(sizeof(struct profiler));
+  memset(g->profiler, 0, sizeof(struct profiler));
+  g->replay = Allocate(sizeof(struct replay));
+  memset(g->replay, 0, sizeof(struct replay));
+  if (rewind)
+    {
+      g->rewind = Allocate(sizeof(struct rewind_buffer));
+      memset(g->rewind, 0, sizeof(struct rewind_buffer));
+    }
+  ClearWorld();
+}
+
+//Gives back everything 'g' holds. Leaves the calling thread working
+//on the interactive game.
+void FreeGame(struct game *g)
+{
+  game = g;
+  ClearWorld();
+  FreeStore(&g->blocks);
+  FreeStore(&g->monsters);
+  if (g->rewind != NULL)
+    {
+      Release(g->rewind->memory);
+      Release(g->rewind->state);
+      Release(g->rewind->packed);
+      Release(g->rewind->saved);
+      Release(g->rewind);
+    }
+  for(int phase = 0; phase < PHASES; phase++)
+    { Release(g->profiler->phases[phase].trace); }
+  Release(g->profiler);
+  Release(g->replay->data);
+  Release(g->replay);
+  Release(g->flow);
+  Release(g->spawners);
+  Release(g->wheel);
+  game = &interactive_game;
+}
+
+/*********************************************************\
+                     Headless Simulation
+\*********************************************************/
+
+//Results of a headless run
+struct sim_stats
+{
+  long ticks;
+  double seconds;
+  int peak_entities;
+  long player_died_at;
+  
+  //Monsters at the start, with those scattered about
+  int start_monsters;
+  struct alloc_counters allocs;
+  
+  //Fingerprint of where everything ended up, to compare runs by
+  Uint32 checksum;
+};
+
+//Folds 'size' bytes at 'data' into the FNV-1a hash 'hash.'
+Uint32 HashBytes(Uint32 hash, const void *data, size_t size)
+{
+  const Uint8 *byte = data;
+  for(size_t i = 0; i < size; i++)
+    { hash = (hash ^ byte[i]) * 16777619u; }
+  return hash;
+}
+
+//Returns a fingerprint of the player and every monster.
+Uint32 WorldChecksum()
+{
+  Uint32 hash = 2166136261u;
+  hash = HashBytes(hash, &game->player.location, sizeof(struct point));
+  hash = HashBytes(hash, &game->player.center, sizeof(struct point));
+  hash = HashBytes(hash, &game->player.fraction, sizeof(struct point));
+  hash = HashBytes(hash, &game->player.alive, sizeof(enum boolean));
+  for(int i = 0; i < game->monsters.count; i++)
+    {
+      hash = HashBytes(hash, &game->monsters.id[i], sizeof(Uint32));
+      hash = HashBytes(hash, &game->monsters.location[i], sizeof(struct point));
+      hash = HashBytes(hash, &game->monsters.center[i], sizeof(struct point));
+      hash = HashBytes(hash, &game->monsters.fraction[i], sizeof(struct point));
+      hash = HashBytes(hash, &game->monsters.speed[i], sizeof(struct vector));
+      hash = HashBytes(hash, &game->monsters.alive[i], sizeof(enum boolean));
+    }
+  return hash;
+}
+
+#define SCATTER_TRIES 1000
+
+/*
+  Scatters up to 'count' extra monsters over the open squares of the
+  game area, each walking in a random direction, so that a run can start
+  from a crowded world rather than waiting for the spawner to fill it.
+  Monsters don't overlap, so a small map fills up before a big 'count'
+  does; it stops once it can't find room. Returns how many were placed.
+*/
+int ScatterMonsters(int count)
+{
+  for(int i = 0; i < count; i++)
+    {
+      struct point location;
+      int tries = 0;
+      do
+	{
+	  location.x = LEFT + Random() % (RIGHT - LEFT + 1);
+	  location.y = BOTTOM + 1 + Random() % (TOP - BOTTOM);
+	}
+      while(!RoomFor(location) && ++tries < SCATTER_TRIES);
+      if (tries == SCATTER_TRIES)
+	{ return i; }
+      
+      struct vector speed = {(Random()%2) ? WALK_SPEED : -WALK_SPEED, 0};
+      SpawnMonsterAt(location, speed);
+    }
+  return count;
+}
+
+//Returns the pool and heap traffic since the counts were 'before.'
+struct alloc_counters AllocsSince(struct alloc_counters before)
+{
+  struct alloc_counters since;
+  since.heap_allocs = game->counters.heap_allocs - before.heap_allocs;
+  since.heap_frees = game->counters.heap_frees - before.heap_frees;
+  since.created = game->counters.created - before.created;
+  since.destroyed = game->counters.destroyed - before.destroyed;
+  since.exhausted = game->counters.exhausted - before.exhausted;
+  since.no_room = game->counters.no_room - before.no_room;
+  since.stale_refs = game->counters.stale_refs - before.stale_refs;
+  return since;
+}
+
+//Updates the peak entity count and the player's death for the tick
+//just run.
+void NoteTick(struct sim_stats *stats)
+{
+  int entities = 1 + game->blocks.count + game->monsters.count;
+  if(entities > stats->peak_entities)
+    { stats->peak_entities = entities; }
+  if(!game->player.alive && stats->player_died_at < 0)
+    { stats->player_died_at = stats->ticks; }
+}
+
+//Starts the game over for a headless run, on a freshly loaded world
+//with 'extra_monsters' scattered about, 'rate' shares of a monster
+//spawned a tick and random numbers from 'seed.'
+void StartHeadless(unsigned int seed, int rate, int extra_monsters)
+{
+  game->headless = TRUE;
+  game->spawn_rate = rate;
+  game->seed = seed;
+  ClearWorld();
+  LoadWorld(map_file);
+  ScatterMonsters(extra_monsters);
+}
+
+/*
+  Runs the simulation without a display for 'ticks' ticks, starting from
+  a freshly loaded world with 'extra_monsters' scattered about and 'rate'
+  shares of a monster spawned a tick (see SPAWN_SHARES). The game
+  carries on past the player's death so every run does the same amount
+  of work; the tick it happened on is recorded instead.
+*/
+struct sim_stats RunHeadless(long ticks, int rate, unsigned int seed, int extra_monsters)
+{
+  struct sim_stats stats = {0, 0, 0, -1, 0, {0}, 0};
+  
+  StartHeadless(seed, rate, extra_monsters);
+  stats.start_monsters = game->monsters.count;
+  
+  struct alloc_counters before = game->counters;
+  double start = Now();
+  for(stats.ticks = 0; stats.ticks < ticks; stats.ticks++)
+    {
+      UpdateState();
+      NoteTick(&stats);
+    }
+  stats.seconds = Now() - start;
+  stats.checksum = WorldChecksum();
+  stats.allocs = AllocsSince(before);
+  return stats;
+}
+
+/*
+  Plays back the replay at 'path' as fast as it will go, with nothing
+  drawn, and returns the same figures as a headless run. The checksum
+  should match the one printed when it was recorded.
+*/
+struct sim_stats RunReplay(const char *path)
+{
+  struct sim_stats stats = {0, 0, 0, -1, 0, {0}, 0};
+  
+  OpenReplay(path);
+  game->seed = game->replay->seed;
+  LoadWorld(map_file);
+  
+  struct alloc_counters before = game->counters;
+  double start = Now();
+  while(!game->replay->finished)
+    {
+      PlayTick();
+      NoteTick(&stats);
+      stats.ticks++;
+    }
+  stats.seconds = Now() - start;
+  stats.checksum = WorldChecksum();
+  stats.allocs = AllocsSince(before);
+  return stats;
+}
+
+void PrintStats(struct sim_stats stats)
+{
+  printf("%ld ticks in %.3f s: %.0f ticks/sec, %.0f ns/tick, peak %d entities",
+	 stats.ticks, stats.seconds, stats.ticks / stats.seconds,
+	 stats.seconds * 1e9 / stats.ticks, stats.peak_entities);
+  if(stats.player_died_at >= 0)
+    { printf(", player died at tick %ld", stats.player_died_at); }
+  printf("\n");
+  printf("objects: %ld created, %ld destroyed, %ld refused (pool full), %ld held back (no room), %ld stale references caught\n",
+	 stats.allocs.created, stats.allocs.destroyed, stats.allocs.exhausted, stats.allocs.no_room, stats.allocs.stale_refs);
+  printf("heap: %ld allocations, %ld frees while ticking\n",
+	 stats.allocs.heap_allocs, stats.allocs.heap_frees);
+  printf("threads: %d, final state checksum %08x\n", pool.workers, stats.checksum);
+}
+
+/*
+  The map the benchmarks play on: BENCH_MAP_SIZE squares each way, with
+  rows of platforms like map.txt's, and its spawner in each top corner.
+  It has room for the largest population to be scattered without any
+  monsters overlapping. It's written to a file of its own for each run.
+*/
+#define BENCH_MAP_SIZE 512
+
+//Writes the benchmark map to 'out.'
+void WriteBenchmarkMap(FILE *out)
+{
+  fprintf(out, "spawner a 40 1 walker\n");
+  for(int row = 0; row < BENCH_MAP_SIZE; row++)
+    {
+      for(int x = 0; x < BENCH_MAP_SIZE; x++)
+	{
+	  int across = x % 20;
+	  char square = '-';
+	  if (row == 0 && (x == 0 || x == BENCH_MAP_SIZE - 1))
+	    { square = 'a'; }
+	  else if (row > 0 && row % 3 == 0 && (row / 3) % 2 == 1)
+	    { square = (across >= 5 && across < 15) ? '*' : '-'; }
+	  else if (row > 0 && row % 3 == 0)
+	    { square = (across < 7 || across >= 13) ? '*' : '-'; }
+	  fputc(square, out);
+	}
+      fputc('\n', out);
+    }
+}
+
+char bench_map[] = "/tmp/helloworld-bench-XXXXXX";
+
+void RemoveBenchmarkMap()
+{ remove(bench_map); }
+
+//Writes the benchmark map and plays on it from now on. The file is
+//removed at exit.
+void UseBenchmarkMap()
+{
+  int fd = mkstemp(bench_map);
+  FILE *out = (fd < 0) ? NULL : fdopen(fd, "w");
+  if (out == NULL)
+    {
+      fprintf(stderr, "Couldn't write the benchmark map %s\n", bench_map);
+      exit(1);
+    }
+  WriteBenchmarkMap(out);
+  fclose(out);
+  atexit(RemoveBenchmarkMap);
+  map_file = bench_map;
+}
+
+//Stops a benchmark whose 'placed' monsters fall short of the 'wanted'
+//it was to measure.
+void CheckPlaced(int placed, int wanted)
+{
+  if (placed < wanted)
+    {
+      fprintf(stderr, "Only %d of %d monsters fit on the benchmark map\n", placed, wanted);
+      exit(1);
+    }
+}
+
+/*
+  Measures how tick cost grows with the monster population, from the
+  two monsters a game starts with up to 100k, on the benchmark map.
+  Fewer ticks are run for larger populations so that each step takes a
+  similar amount of time. Stops if a population couldn't all be placed.
+*/
+void RunBenchmark()
+{
+  int populations[] = {2, 10, 100, 1000, 10000, 100000};
+  int steps = sizeof(populations) / sizeof(populations[0]);
+  UseBenchmarkMap();
+  
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  printf("%d thread%s and %ld CPU%s, %dx%d map\n", pool.workers, pool.workers == 1 ? "" : "s",
+	 cpus, cpus == 1 ? "" : "s", BENCH_MAP_SIZE, BENCH_MAP_SIZE);
+  printf("%10s %8s %12s %14s %10s %8s\n", "monsters", "ticks", "ticks/sec", "ns/tick", "peak", "mallocs");
+  for(int i = 0; i < steps; i++)
+    {
+      long ticks = 2000000 / populations[i];
+      if(ticks > 20000)
+	{ ticks = 20000; }
+      else if(ticks < 20)
+	{ ticks = 20; }
+      
+      struct sim_stats stats = RunHeadless(ticks, 0, 1, populations[i] - 2);
+      CheckPlaced(stats.start_monsters, populations[i]);
+      printf("%10d %8ld %12.0f %14.0f %10d %8ld\n", stats.start_monsters, stats.ticks,
+	     stats.ticks / stats.seconds, stats.seconds * 1e9 / stats.ticks,
+	     stats.peak_entities, stats.allocs.heap_allocs);
+    }
+}
+
+/*
+  Times each set of pixel kernels the CPU supports against SDL doing the
+  same job: full-screen fills, and the game's 32x32 sprites blitted by
+  colorkey and by alpha all over the screen. Each kernel's pixels are
+  checked against the plain C version's.
+*/
+enum BlitTest {FILL_TEST, COLORKEY_TEST, ALPHA_TEST};
+
+#define BLIT_POSITIONS 300
+
+//Runs one test 'reps' times with 'with' (or SDL, if NULL) on 'screen.'
+//Returns the seconds taken.
+double TimeBlitTest(enum BlitTest test, const struct pixel_kernels *with, SDL_Surface *screen,
+		    SDL_Surface *sprite, SDL_Rect *positions, int reps)
+{
+  ClearScreen(screen, 0);
+  const struct pixel_kernels *selected = kernels;
+  kernels = with;
+  
+  double start = Now();
+  for(int rep = 0; rep < reps; rep++)
+    {
+      if (test == FILL_TEST)
+	{
+	  Uint32 color = SDL_MapRGB(screen->format, rep, 0, 255 - rep);
+	  if (with == NULL)
+	    { SDL_FillRect(screen, NULL, color); }
+	  else
+	    { with->fill((Uint32 *)screen->pixels, screen->pitch, screen->w, screen->h, color); }
+	  continue;
+	}
+      for(int i = 0; i < BLIT_POSITIONS; i++)
+	{
+	  SDL_Rect dest = positions[i];
+	  if (with == NULL)
+	    { SDL_BlitSurface(sprite, NULL, screen, &dest); }
+	  else
+	    { KernelBlit(sprite, NULL, screen, &dest); }
+	}
+    }
+  double seconds = Now() - start;
+  
+  kernels = selected;
+  return seconds;
+}
+
+void RunBlitBenchmark()
+{
+  const struct pixel_kernels *candidates[3] = {&scalar_kernels, NULL, NULL};
+  int count = 1;
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    { candidates[count++] = &sse2_kernels; }
+  if (__builtin_cpu_supports("avx2"))
+    { candidates[count++] = &avx2_kernels; }
+#endif
+  
+  SDL_Surface *screen = SDL_CreateRGBSurface(SDL_SWSURFACE, WIDTH, HEIGHT, 32,
+					     0x00ff0000, 0x0000ff00, 0x000000ff, 0);
+  SDL_Surface *reference = SDL_CreateRGBSurface(SDL_SWSURFACE, WIDTH, HEIGHT, 32,
+						0x00ff0000, 0x0000ff00, 0x000000ff, 0);
+  SDL_Surface *keyed = LoadSprite("monster.bmp");
+  if (screen == NULL || reference == NULL || keyed == NULL)
+    {
+      fprintf(stderr, "Couldn't set up the blit benchmark: %s\n", SDL_GetError());
+      exit(1);
+    }
+  
+  //A copy of the sprite whose alpha fades across it
+  SDL_Surface *faded = SDL_CreateRGBSurface(SDL_SWSURFACE, keyed->w, keyed->h, 32,
+					    0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000);
+  for(int y = 0; y < keyed->h; y++)
+    for(int x = 0; x < keyed->w; x++)
+      {
+	Uint32 pixel = ((Uint32 *)((Uint8 *)keyed->pixels + y * keyed->pitch))[x];
+	Uint32 alpha = (pixel & 0x00ffffff) ? (x * 255 / (keyed->w - 1)) : 0;
+	((Uint32 *)((Uint8 *)faded->pixels + y * faded->pitch))[x] = (pixel & 0x00ffffff) | alpha << 24;
+      }
+  SDL_SetAlpha(faded, SDL_SRCALPHA, 255);
+  
+  //Sprites land everywhere, including off the edges
+  SDL_Rect positions[BLIT_POSITIONS];
+  srand(1);
+  for(int i = 0; i < BLIT_POSITIONS; i++)
+    {
+      positions[i].x = rand() % (WIDTH + TILE_WIDTH) - TILE_WIDTH / 2;
+      positions[i].y = rand() % (HEIGHT + TILE_HEIGHT) - TILE_HEIGHT / 2;
+      positions[i].w = TILE_WIDTH;
+      positions[i].h = TILE_HEIGHT;
+    }
+  
+  const char *names[] = {"fill 640x480", "colorkey 32x32", "alpha 32x32"};
+  SDL_Surface *sprites[] = {NULL, keyed, faded};
+  int reps[] = {500, 200, 200};
+  printf("%-16s %-8s %12s %12s %s\n", "test", "by", "ns/op", "Mpixel/s", "");
+  for(int test = FILL_TEST; test <= ALPHA_TEST; test++)
+    {
+      int ops = (test == FILL_TEST) ? reps[test] : reps[test] * BLIT_POSITIONS;
+      double pixels = (test == FILL_TEST) ? (double)WIDTH * HEIGHT : TILE_WIDTH * TILE_HEIGHT;
+      
+      double seconds = TimeBlitTest(test, NULL, screen, sprites[test], positions, reps[test]);
+      printf("%-16s %-8s %12.1f %12.1f\n", names[test], "SDL",
+	     seconds * 1e9 / ops, pixels * ops / seconds / 1e6);
+      
+      TimeBlitTest(test, &scalar_kernels, reference, sprites[test], positions, reps[test]);
+      for(int k = 0; k < count; k++)
+	{
+	  seconds = TimeBlitTest(test, candidates[k], screen, sprites[test], positions, reps[test]);
+	  enum boolean same = TRUE;
+	  for(int y = 0; y < HEIGHT && same; y++)
+	    {
+	      same = memcmp((Uint8 *)screen->pixels + y * screen->pitch,
+			    (Uint8 *)reference->pixels + y * reference->pitch, WIDTH * 4) == 0;
+	    }
+	  printf("%-16s %-8s %12.1f %12.1f %s\n", names[test], candidates[k]->name,
+		 seconds * 1e9 / ops, pixels * ops / seconds / 1e6, same ? "" : "MISMATCH");
+	}
+    }
+  
+  SDL_FreeSurface(faded);
+  SDL_FreeSurface(keyed);
+  SDL_FreeSurface(reference);
+  SDL_FreeSurface(screen);
+}
+
+/*
+  Times drawing animated monsters, each on a random frame at a random
+  place on the screen, a sprite at a time in the order they come and
+  from a sorted draw list, at a few numbers of them.
+*/
+#define SPRITE_PASSES 20
+
+void RunSpriteBenchmark()
+{
+  SDL_Surface *screen = SDL_CreateRGBSurface(SDL_SWSURFACE, WIDTH, HEIGHT, 32,
+					     0x00ff0000, 0x0000ff00, 0x000000ff, 0);
+  if (screen == NULL)
+    {
+      fprintf(stderr, "Couldn't set up the sprite benchmark: %s\n", SDL_GetError());
+      exit(1);
+    }
+  LoadAssets(screen);
+  enum Animation played[] = {MONSTER_WALK, MONSTER_WALK_LEFT, MONSTER_DIE};
+  static struct draw_list list;
+  
+  int counts[] = {100, 1000, 10000};
+  printf("%d-cell atlas, %s\n", assets.cells, KernelsCanBlit(assets.atlas, screen) ? "pixel kernels" : "SDL");
+  printf("%8s %16s %16s\n", "sprites", "ns/sprite alone", "ns/sprite listed");
+  for(int c = 0; c < 3; c++)
+    {
+      int count = counts[c];
+      struct draw *sprites = Allocate(count * sizeof(struct draw));
+      srand(1);
+      for(int i = 0; i < count; i++)
+	{
+	  struct animation *animation = &animations[played[rand() % 3]];
+	  sprites[i].icon = &animation->frames[rand() % animation->frame_count];
+	  sprites[i].x = rand() % WIDTH;
+	  sprites[i].y = rand() % HEIGHT;
+	}
+      
+      double start = Now();
+      for(int pass = 0; pass < SPRITE_PASSES; pass++)
+	for(int i = 0; i < count; i++)
+	  { DrawIcon(screen, sprites[i].icon, sprites[i].x, sprites[i].y); }
+      double alone = Now() - start;
+      
+      start = Now();
+      for(int pass = 0; pass < SPRITE_PASSES; pass++)
+	for(int i = 0; i < count; )
+	  {
+	    for(; i < count && list.count < MAX_DRAWS; i++)
+	      { list.draws[list.count++] = sprites[i]; }
+	    DrawList(screen, &list, NULL);
+	  }
+      double listed = Now() - start;
+      
+      int drawn = count * SPRITE_PASSES;
+      printf("%8d %16.1f %16.1f\n", count, alone * 1e9 / drawn, listed * 1e9 / drawn);
+      Release(sprites);
+    }
+  SDL_FreeSurface(screen);
+}
+
+/*
+  Times the collision tests on their own: scatters 'bodies' monsters
+  over the benchmark map, gives each a random speed of up to 0.7
+  squares a tick each way, and sweeps every one of them along its move
+  over and over without moving anything.
+*/
+#define COLLIDE_PASSES 50
+
+void RunCollisionBenchmark(int bodies)
+{
+  UseBenchmarkMap();
+  game->seed = 1;
+  ClearWorld();
+  LoadWorld(map_file);
+  int placed = ScatterMonsters(bodies);
+  CheckPlaced(placed, bodies);
+  for(int i = 0; i < game->monsters.count; i++)
+    {
+      game->monsters.speed[i].x = (Random() % 141 - 70) * TILE_WIDTH * SUBPIXELS / 100;
+      game->monsters.speed[i].y = (Random() % 141 - 70) * TILE_HEIGHT * SUBPIXELS / 100;
+    }
+  
+  long sweeps = 0, collisions = 0;
+  double start = Now();
+  for(int pass = 0; pass < COLLIDE_PASSES; pass++)
+    for(int i = 0; i < game->monsters.count; i++)
+      {
+	struct entity_ref self = {MONSTER, game->monsters.id[i]};
+	struct point pixel = PixelOf(game->monsters.location[i], game->monsters.center[i]);
+	struct body_move move = SweepBody(pixel, game->monsters.fraction[i], game->monsters.speed[i], self);
+	sweeps++;
+	collisions += move.x.blocked + move.y.blocked;
+      }
+  double seconds = Now() - start;
+  
+  printf("%d bodies on a %dx%d map, %d passes\n", placed, BENCH_MAP_SIZE, BENCH_MAP_SIZE, COLLIDE_PASSES);
+  printf("%.0f moves/sec, %.0f collisions/sec, %.0f ns/move\n",
+	 sweeps / seconds, collisions / seconds, seconds * 1e9 / sweeps);
+}
+
+/*
+  Times asking which of a crowd of bodies are standing on platforms,
+  the way Sweep used to find out, by looking for platforms in the grid
+  squares under each one; from the solidity map a body at a time; and
+  from it 64 at a time, with each version of OnSolidScalar. All of them
+  should count the same bodies. They're scattered over the benchmark
+  map.
+*/
+#define SOLID_PASSES 200
+
+//Returns TRUE if the grid has a platform under a body at 'pixel,' as
+//OnSolid does from the solidity map.
+enum boolean OnGridPlatform(struct point pixel)
+{
+  int bottom = pixel.y - BODY_HALF;
+  if (bottom == 0)
+    { return TRUE; }
+  int row = bottom / TILE_HEIGHT - 1;
+  if (row < BOTTOM || bottom % TILE_HEIGHT > 1)
+    { return FALSE; }
+  for(int x = (pixel.x - BODY_HALF) / TILE_WIDTH; x <= (pixel.x + BODY_HALF - 1) / TILE_WIDTH; x++)
+    {
+      if (FindInCell(x, row, PLATFORM).type == PLATFORM)
+	{ return TRUE; }
+    }
+  return FALSE;
+}
+
+void RunSolidBenchmark(int bodies)
+{
+  static struct point pixels[MAX_MONSTERS];
+  UseBenchmarkMap();
+  game->seed = 1;
+  ClearWorld();
+  LoadWorld(map_file);
+  CheckPlaced(ScatterMonsters(bodies), bodies);
+  int count = game->monsters.count & ~63;
+  for(int i = 0; i < count; i++)
+    { pixels[i] = PixelOf(game->monsters.location[i], game->monsters.center[i]); }
+  printf("%d bodies on a %dx%d map, %d passes\n", count, BENCH_MAP_SIZE, BENCH_MAP_SIZE, SOLID_PASSES);
+  
+  const char *names[4] = {"grid", "bitboard", "batch scalar", "batch avx2"};
+  Uint64 (*batches[4])(const struct point *pixels, int count) = {NULL, NULL, OnSolidScalar, NULL};
+  int ways = 3;
+#ifdef HAVE_ON_SOLID_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    { batches[ways++] = OnSolidAVX2; }
+#endif
+  long first = -1;
+  for(int way = 0; way < ways; way++)
     {
-      if ( SDL_LockSurface(screen) < 0 )
-	{ return; }
+      long standing = 0;
+      double start = Now();
+      for(int pass = 0; pass < SOLID_PASSES; pass++)
+	{
+	  if (way == 0)
+	    for(int i = 0; i < count; i++)
+	      { standing += OnGridPlatform(pixels[i]); }
+	  else if (way == 1)
+	    for(int i = 0; i < count; i++)
+	      { standing += OnSolid(pixels[i]); }
+	  else
+	    for(int i = 0; i < count; i += 64)
+	      { standing += __builtin_popcountll(batches[way](pixels + i, 64)); }
+	}
+      double seconds = Now() - start;
+      if (first < 0)
+	{ first = standing; }
+      printf("  %-12s %6.2f ns/body, %ld standing%s\n", names[way],
+	     seconds * 1e9 / ((double)count * SOLID_PASSES), standing / SOLID_PASSES,
+	     standing == first ? "" : " (DIFFERENT)");
+    }
+}
+
+/*
+  Times the flow field rebuild a player's move costs, on the benchmark
+  map. The player walks FLOW_STEPS squares, one at a time: falling when
+  there's nothing underneath, otherwise stepping left or right along
+  the platform, and starting again somewhere else when boxed in. The
+  field is rebuilt at every square, as the game would. The walk is
+  worked out (and the map read in along it) first, so the timing is of
+  the search alone.
+*/
+#define FLOW_STEPS 5000
+
+//Returns a random open square with something underneath it.
+struct point RandomStandingSquare()
+{
+  struct point at;
+  int tries = 0;
+  do
+    {
+      at.x = LEFT + Random() % (RIGHT - LEFT + 1);
+      at.y = BOTTOM + Random() % (TOP - BOTTOM + 1);
+      StreamAround(at);
+    }
+  while(!(Open(at.x, at.y) && Supported(at.x, at.y)) && ++tries < SCATTER_TRIES);
+  return at;
+}
+
+void RunFlowBenchmark()
+{
+  static struct point walk[FLOW_STEPS];
+  UseBenchmarkMap();
+  game->seed = 1;
+  ClearWorld();
+  LoadWorld(map_file);
+  walk[0] = RandomStandingSquare();
+  for(int i = 1; i < FLOW_STEPS; i++)
+    {
+      struct point at = walk[i - 1];
+      int side = (Random() & 1) ? 1 : -1;
+      if (!Supported(at.x, at.y))
+	{ at.y--; }
+      else if (Open(at.x + side, at.y))
+	{ at.x += side; }
+      else if (Open(at.x - side, at.y))
+	{ at.x -= side; }
+      else
+	{ at = RandomStandingSquare(); }
+      StreamAround(at);
+      walk[i] = at;
     }
   
-  //Clear the screen to the background color (black)
-  ClearScreen(screen, SDL_MapRGB(screen->format, 0,0,0));
-  
-  //Draw the platforms
-  for(struct object_list *blockp = g_blocks; blockp != NULL; blockp = blockp->next_object)
-    { DrawObject(screen, &(blockp->object)); }
-  
-  //Draw the monsters 
-  for(struct object_list *monsterp = g_monsters; monsterp != NULL; monsterp = monsterp->next_object)
-    { DrawObject(screen, &(monsterp->object)); }
-  
-  //Draw the player 
-  DrawTortoise(screen);
-  
-  if ( SDL_MUSTLOCK(screen) )
-    { SDL_UnlockSurface(screen); }
+  long reached = 0;
+  double worst = 0, total = 0;
+  for(int i = 0; i < FLOW_STEPS; i++)
+    {
+      double start = Now();
+      BuildFlowField(walk[i]);
+      double seconds = Now() - start;
+      total += seconds;
+      if (seconds > worst)
+	{ worst = seconds; }
+      reached += game->flow->reached;
+    }
   
-  //Update screen for player to see
-  SDL_UpdateRect(screen, 0, 0, WIDTH, HEIGHT);
+  printf("%dx%d map, %dx%d field (%d squares)\n", game->world.width, game->world.height,
+	 FLOW_SIZE, FLOW_SIZE, FLOW_SIZE * FLOW_SIZE);
+  printf("%d squares walked, a whole rebuild at each: %.1f us average, %.1f us worst, %.0f squares reached on average\n",
+	 FLOW_STEPS, total * 1e6 / FLOW_STEPS, worst * 1e6, (double)reached / FLOW_STEPS);
 }
 
-//At end game, render either a "victory" screen or a "loss" screen
-void RenderFinal(SDL_Surface *screen, enum boolean victory)
+/*
+  Times keeping each tick in the rewind buffer, and putting back ticks
+  from it, for a few numbers of monsters. To check the states put back
+  are right, it also goes back REWIND_STEP ticks, plays them again and
+  compares the world with how it was the first time.
+*/
+#define REWIND_BENCH_TICKS (3 * REWIND_FRAMES)
+
+//The most ticks played waiting for the frames to come round the end of
+//the rewind memory
+#define WRAP_BENCH_TICKS   (100 * REWIND_FRAMES)
+
+//Returns TRUE if the frames of the last 'ticks' ticks run off the end
+//of the rewind memory and on from the start.
+enum boolean WrapsWithin(int ticks)
 {
-  if ( SDL_MUSTLOCK(screen) )
+  for(int n = game->rewind->count - ticks; n < game->rewind->count; n++)
     {
-      if ( SDL_LockSurface(screen) < 0 )
-	{ return; }
+      if (n > 0 && RewindFrame(n)->offset < RewindFrame(n - 1)->offset)
+	{ return TRUE; }
+    }
+  return FALSE;
+}
+
+/*
+  Plays on until the last REWIND_STEP ticks' frames run round the end
+  of the rewind memory, then rewinds to before that point and plays
+  them again, keeping frames as it goes, twice over: the second time
+  goes back over frames written after the first rewind. It plays at
+  least REWIND_STEP ticks first, so there are checksums for every tick
+  it goes back over, even when the memory has already come round (as
+  it does when a few states fill it). Returns TRUE if
+  the game played out the same each time, and sets 'ticks' to the ticks
+  it took to come round, or -1 if it never did.
+*/
+enum boolean RewindAcrossWrap(long *ticks)
+{
+  static Uint32 checksums[REWIND_FRAMES];
+  for(*ticks = 0; *ticks < REWIND_STEP || !WrapsWithin(REWIND_STEP); (*ticks)++)
+    {
+      if (*ticks == WRAP_BENCH_TICKS)
+	{
+	  *ticks = -1;
+	  return FALSE;
+	}
+      UpdateState();
+      CaptureRewind();
+      checksums[*ticks % REWIND_FRAMES] = WorldChecksum();
     }
   
-  ClearScreen(screen, SDL_MapRGB(screen->format, 0,0,0));
+  enum boolean same = TRUE;
+  for(int pass = 0; pass < 2; pass++)
+    {
+      RewindBack();
+      for(long tick = *ticks - REWIND_STEP; tick < *ticks; tick++)
+	{
+	  UpdateState();
+	  CaptureRewind();
+	  same = same && WorldChecksum() == checksums[tick % REWIND_FRAMES];
+	}
+    }
+  return same;
+}
+
+void RunRewindBenchmark()
+{
+  static Uint32 checksums[REWIND_BENCH_TICKS];
+  int populations[] = {100, 1000, 10000};
+  UseBenchmarkMap();
+  for(int p = 0; p < 3; p++)
+    {
+      game->seed = 1;
+      ClearWorld();
+      LoadWorld(map_file);
+      int placed = ScatterMonsters(populations[p]);
+      CheckPlaced(placed, populations[p]);
+      game->rewind->keyframes = game->rewind->keyframe_bytes = 0;
+      game->rewind->deltas = game->rewind->delta_bytes = 0;
+      game->rewind->seconds = 0;
+      for(int tick = 0; tick < REWIND_BENCH_TICKS; tick++)
+	{
+	  UpdateState();
+	  CaptureRewind();
+	  checksums[tick] = WorldChecksum();
+	}
+      long size = StateSize();
+      double capture = game->rewind->seconds;
+      long frames = game->rewind->keyframes + game->rewind->deltas;
       
-  SDL_Surface *image;
-  SDL_Rect dest = { 0, 0, WIDTH, HEIGHT };
+      int restores = 0;
+      double start = Now();
+      for(int n = 0; n < game->rewind->count; n++, restores++)
+	{ RestoreFrame(n); }
+      double restore = Now() - start;
+      
+      //Go back and play forward again
+      int back = REWIND_STEP < game->rewind->count ? REWIND_STEP : game->rewind->count - 1;
+      RestoreFrame(game->rewind->count - 1 - back);
+      enum boolean same = TRUE;
+      for(int tick = REWIND_BENCH_TICKS - back; tick < REWIND_BENCH_TICKS; tick++)
+	{
+	  UpdateState();
+	  same = same && WorldChecksum() == checksums[tick];
+	}
+      
+      printf("%d monsters on a %dx%d map, %ld byte states, %d ticks kept\n",
+	     placed, BENCH_MAP_SIZE, BENCH_MAP_SIZE, size, game->rewind->count);
+      printf("  capture %.1f us/tick, keyframes %.0f bytes, deltas %.0f bytes, restore %.1f us\n",
+	     capture * 1e6 / frames, (double)game->rewind->keyframe_bytes / game->rewind->keyframes,
+	     game->rewind->deltas ? (double)game->rewind->delta_bytes / game->rewind->deltas : 0,
+	     restore * 1e6 / restores);
+      printf("  went back %d ticks and played them again: %s\n", back, same ? "same" : "DIFFERENT");
+      
+      long ticks;
+      same = RewindAcrossWrap(&ticks);
+      if (ticks < 0)
+	{ printf("  the frames didn't come round the end of the memory in %d ticks\n", WRAP_BENCH_TICKS); }
+      else
+	{
+	  printf("  came round the end of the memory after %ld more ticks, went back over it twice: %s\n",
+		 ticks, same ? "same" : "DIFFERENT");
+	}
+    }
+}
+
+/*********************************************************\
+                    Offscreen Rendering
+\*********************************************************/
+
+/*
+  The game can be drawn into a surface in memory instead of the window,
+  so drawing can be timed and checked on a machine with no display.
+  --render plays a game just as --headless does and draws every tick
+  of it, FRAMES_PER_TICK frames a tick as the window would at its
+  usual frame rate. The frames can be written out as PPM images, and
+  the last one compared with an image kept from an earlier run.
+*/
+#define FRAMES_PER_TICK 3
+
+//Where to write each frame drawn offscreen, if anywhere, and the image
+//the last one should match, if any
+char *frames_dir = NULL;
+char *golden_file = NULL;
+
+//Returns a surface in memory laid out like the window.
+SDL_Surface *OffscreenSurface()
+{
+  SDL_Surface *screen = SDL_CreateRGBSurface(SDL_SWSURFACE, WIDTH, HEIGHT, 32,
+					     0x00ff0000, 0x0000ff00, 0x000000ff, 0);
+  if (screen == NULL)
+    {
+      fprintf(stderr, "Couldn't create an offscreen surface: %s\n", SDL_GetError());
+      exit(1);
+    }
+  return screen;
+}
+
+//Has the next frame start afresh, with the camera in the corner and
+//the whole background drawn again.
+void ResetRenderer()
+{
+  camera.x = camera.y = 0;
+  render_cache.revision = -1;
+}
+
+//Copies row 'y' of 'screen,' which must have 32-bit pixels, into 'rgb'
+//as a byte each of red, green and blue per pixel.
+void FrameRow(SDL_Surface *screen, int y, Uint8 *rgb)
+{
+  SDL_PixelFormat *format = screen->format;
+  Uint32 *pixel = (Uint32 *)((Uint8 *)screen->pixels + y * screen->pitch);
+  for(int x = 0; x < screen->w; x++)
+    {
+      rgb[3 * x] = pixel[x] >> format->Rshift;
+      rgb[3 * x + 1] = pixel[x] >> format->Gshift;
+      rgb[3 * x + 2] = pixel[x] >> format->Bshift;
+    }
+}
+
+//Folds the pixels of 'screen' into the FNV-1a hash 'hash.'
+Uint32 HashFrame(Uint32 hash, SDL_Surface *screen)
+{
+  Uint8 rgb[3 * WIDTH];
+  for(int y = 0; y < HEIGHT; y++)
+    {
+      FrameRow(screen, y, rgb);
+      hash = HashBytes(hash, rgb, sizeof(rgb));
+    }
+  return hash;
+}
+
+//Writes 'screen' to 'path' as a PPM image. Returns FALSE if it couldn't.
+enum boolean WriteFrame(SDL_Surface *screen, const char *path)
+{
+  FILE *out = fopen(path, "wb");
+  if (out == NULL)
+    { return FALSE; }
+  fprintf(out, "P6\n%d %d\n255\n", WIDTH, HEIGHT);
+  Uint8 rgb[3 * WIDTH];
+  for(int y = 0; y < HEIGHT; y++)
+    {
+      FrameRow(screen, y, rgb);
+      fwrite(rgb, 1, sizeof(rgb), out);
+    }
+  enum boolean written = !ferror(out);
+  return fclose(out) == 0 && written;
+}
+
+/*
+  Compares 'screen' with the PPM image at 'path' and prints how many
+  pixels differ, and where the first is. Returns FALSE if any do, or
+  the image can't be read or isn't the size of the screen.
+*/
+enum boolean MatchesGolden(SDL_Surface *screen, const char *path)
+{
+  FILE *in = fopen(path, "rb");
+  int width = 0, height = 0, depth = 0;
+  if (in == NULL || fscanf(in, "P6 %d %d %d", &width, &height, &depth) != 3 ||
+      fgetc(in) == EOF || width != WIDTH || height != HEIGHT || depth != 255)
+    {
+      fprintf(stderr, "%s isn't a %dx%d PPM image\n", path, WIDTH, HEIGHT);
+      if (in != NULL)
+	{ fclose(in); }
+      return FALSE;
+    }
+  
+  Uint8 drawn[3 * WIDTH], golden[3 * WIDTH];
+  long differ = 0;
+  int first_x = 0, first_y = 0;
+  for(int y = 0; y < HEIGHT; y++)
+    {
+      if (fread(golden, 1, sizeof(golden), in) != sizeof(golden))
+	{ memset(golden, 0, sizeof(golden)); }
+      FrameRow(screen, y, drawn);
+      for(int x = 0; x < WIDTH; x++)
+	{
+	  if (memcmp(&drawn[3 * x], &golden[3 * x], 3) == 0)
+	    { continue; }
+	  if (differ++ == 0)
+	    {
+	      first_x = x;
+	      first_y = y;
+	    }
+	}
+    }
+  fclose(in);
   
-  if(victory)
-    { image = SDL_LoadBMP("victory.bmp"); }
+  if (differ == 0)
+    { printf("last frame matches %s\n", path); }
   else
-    { image = SDL_LoadBMP("loss.bmp"); }
+    { printf("last frame DIFFERS from %s in %ld pixels, first at (%d, %d)\n", path, differ, first_x, first_y); }
+  return differ == 0;
+}
+
+/*
+  Plays a game of 'ticks' ticks as RunHeadless does and draws each tick
+  into a surface in memory, writing the frames to 'frames_dir' if it's
+  set. Prints how fast the frames were drawn, and the sprites in them,
+  and checksums of the game and of every frame drawn. Returns FALSE if
+  there's a 'golden_file' and the last frame doesn't match it.
+*/
+enum boolean RunRender(long ticks, int rate, unsigned int seed)
+{
+  static struct snapshot snap;
+  SDL_Surface *screen = OffscreenSurface();
+  LoadAssets(screen);
   
-  if ( image == NULL )
+  StartHeadless(seed, rate, 0);
+  ResetRenderer();
+  
+  Uint32 frames_hash = 2166136261u;
+  long frames = 0, blits = game->blits;
+  double seconds = 0, blit_seconds = game->blit_seconds;
+  for(long tick = 0; tick < ticks; tick++)
     {
-      fprintf(stderr, "Couldn't load %s: %s\n", "victory.bmp", SDL_GetError());
-      return;
+      UpdateState();
+      TakeSnapshot(&snap);
+      for(int f = 0; f < FRAMES_PER_TICK; f++, frames++)
+	{
+	  double start = Now();
+	  RenderState(screen, &snap, (float)f / FRAMES_PER_TICK);
+	  seconds += Now() - start;
+	  frames_hash = HashFrame(frames_hash, screen);
+	  
+	  char path[FILENAME_MAX];
+	  if (frames_dir == NULL)
+	    { continue; }
+	  snprintf(path, sizeof(path), "%s/frame%06ld.ppm", frames_dir, frames);
+	  if (!WriteFrame(screen, path))
+	    {
+	      fprintf(stderr, "Couldn't write frame %s\n", path);
+	      exit(1);
+	    }
+	}
     }
+  
+  blits = game->blits - blits;
+  blit_seconds = game->blit_seconds - blit_seconds;
+  printf("%ld frames of %ld ticks in %.3f s: %.0f frames/sec, %.1f sprites/frame, %.0f ns/sprite\n",
+	 frames, ticks, seconds, frames / seconds, (double)blits / frames, blit_seconds * 1e9 / blits);
+  printf("final state checksum %08x, frames checksum %08x\n", WorldChecksum(), frames_hash);
+  if (frames_dir != NULL)
+    { printf("wrote frames to %s\n", frames_dir); }
+  enum boolean matched = (golden_file == NULL || MatchesGolden(screen, golden_file));
+  SDL_FreeSurface(screen);
+  return matched;
+}
+
+/*
+  Times RenderState drawing games with a few numbers of monsters
+  scattered over the map, FRAMES_PER_TICK frames a tick as --render
+  draws them: whole frames, and the sprites in them on their own.
+*/
+#define RENDER_BENCH_TICKS 200
+
+void RunRenderBenchmark()
+{
+  static struct snapshot snap;
+  SDL_Surface *screen = OffscreenSurface();
+  LoadAssets(screen);
+  
+  int populations[] = {100, 1000, 10000};
+  printf("%d-cell atlas, %s, %d ticks on %s\n", assets.cells,
+	 KernelsCanBlit(assets.atlas, screen) ? "pixel kernels" : "SDL", RENDER_BENCH_TICKS, map_file);
+  printf("%8s %8s %14s %12s %10s\n", "asked", "monsters", "sprites/frame", "frames/sec", "ns/sprite");
+  for(int p = 0; p < 3; p++)
+    {
+      StartHeadless(1, 0, populations[p]);
+      int placed = game->monsters.count;
+      ResetRenderer();
       
-  SDL_BlitSurface(image, NULL, screen, &dest);
-      
-  if ( SDL_MUSTLOCK(screen) )
-    { SDL_UnlockSurface(screen); }
+      long frames = 0, blits = game->blits;
+      double seconds = 0, blit_seconds = game->blit_seconds;
+      for(int tick = 0; tick < RENDER_BENCH_TICKS; tick++)
+	{
+	  UpdateState();
+	  TakeSnapshot(&snap);
+	  double start = Now();
+	  for(int f = 0; f < FRAMES_PER_TICK; f++, frames++)
+	    { RenderState(screen, &snap, (float)f / FRAMES_PER_TICK); }
+	  seconds += Now() - start;
+	}
+      blits = game->blits - blits;
+      blit_seconds = game->blit_seconds - blit_seconds;
+      printf("%8d %8d %14.1f %12.0f %10.1f\n", populations[p], placed,
+	     (double)blits / frames, frames / seconds, blit_seconds * 1e9 / blits);
+    }
+  SDL_FreeSurface(screen);
+}
+
+/*********************************************************\
+                          Batches
+\*********************************************************/
+
+/*
+  A batch is many headless games played side by side, for balance
+  testing and training bots without a process per game. Each game has
+  a world of its own, loaded from the same map, and a seed of its own:
+  the first game's seed is the one asked for and each next game's is
+  one more. StepBatch runs every game on for some ticks, spread over
+  the workers a whole game at a time, and returns once they all have,
+  so a caller can look at the games (or change them) between steps.
+  Nothing one game does touches another, so each plays out exactly as
+  a headless run with its seed would, however many threads there are.
+*/
+
+//Room for monsters in each game of a batch. Less than a game on its
+//own gets, since there are many of them.
+#define BATCH_MONSTERS (1 << 14)
+
+struct batch
+{
+  int count;
+  struct game *games;
+  struct sim_stats *stats;
   
-  SDL_UpdateRect(screen, 0, 0, WIDTH, HEIGHT);
+  //Each game's counts once it was loaded, to tell heap use while
+  //ticking from setting up
+  struct alloc_counters *loaded;
   
-  //Sleep a moment so player doesn't accidentally exit before he's had the
-  //opportunity to realize the game is over.
-  sleep(1);
+  unsigned int seed;
+  int spawn_rate;
+  int extra_monsters;
   
-  //Wait for player input to exit.
-  SDL_Event event;
-  SDL_WaitEvent(&event);
-  exit(0);
-}
+  //How long the current step runs each game for
+  long ticks;
+};
 
-//Handle user input
-void HandleEvents()
+//The batch the workers are busy with
+struct batch *stepping;
+
+//Loads games 'first' to 'last' of the batch being set up.
+void StartGames(int first, int last)
 {
-  SDL_Event event;
+  for(int i = first; i < last; i++)
+    {
+      InitGame(&stepping->games[i], BATCH_MONSTERS, FALSE);
+      StartHeadless(stepping->seed + i, stepping->spawn_rate, stepping->extra_monsters);
+      stepping->loaded[i] = game->counters;
+    }
+}
 
-  while(SDL_PollEvent(&event))
+//Runs games 'first' to 'last' of the batch being stepped on for the
+//step's ticks.
+void StepGames(int first, int last)
+{
+  for(int i = first; i < last; i++)
     {
-      switch (event.type)
+      struct sim_stats *stats = &stepping->stats[i];
+      game = &stepping->games[i];
+      double start = Now();
+      for(long tick = 0; tick < stepping->ticks; tick++)
 	{
-	case SDL_KEYDOWN:
-	  switch (event.key.keysym.sym)
-	    {
-	      //Left and Right keys cause the user to accelerate respectively
-	      //Up key jumps.
-	    case SDLK_UP:
-	      if(onFloor(&player))
-		{ player.speed.y = 0.7; }
-	      break;
-	    case SDLK_DOWN:
-	      if(onFloor(&player))
-		{ player.speed.y = -0.7; }
-	      break;
-	    case SDLK_RIGHT:
-	      player.speed.x += 0.25;
-	      break;
-	    case SDLK_LEFT:
-	      player.speed.x -= 0.25;
-	      break;
-	    case SDLK_UNKNOWN:
-	      break;
-	    default:
-	      break;
-	    }
-	  break;
-	case SDL_KEYUP:
-	  switch (event.key.keysym.sym)
-	    {
-	      //Releasing the left and right keys cause the player to accelerate
-	      //in the opposite direction (to counteract the initial acceleration)
-	      //unless the player has already been stopped by a wall.
-	    case SDLK_UP:
-	      break;
-	    case SDLK_DOWN:
-	      break;
-	    case SDLK_RIGHT:
-	      if(blocked_left)
-		{ blocked_left= FALSE; }
-	      else
-		{ player.speed.x -= 0.25; }
-	      break;
-	    case SDLK_LEFT:
-	      if(blocked_right)
-		{ blocked_right= FALSE; }
-	      else
-		{ player.speed.x += 0.25; }
-	      break;
-	    case SDLK_UNKNOWN:
-	      break;
-	    default:
-	      break;
-	    }
-	  break;
-	case SDL_QUIT:
-	  exit(0);
+	  UpdateState();
+	  NoteTick(stats);
+	  stats->ticks++;
 	}
+      stats->seconds += Now() - start;
+    }
+}
+
+/*
+  Makes a batch of 'count' headless games on the map, each with
+  'extra_monsters' scattered about and 'rate' shares of a monster
+  spawned a tick (see RunHeadless), seeded from 'seed' on.
+*/
+struct batch *NewBatch(int count, unsigned int seed, int rate, int extra_monsters)
+{
+  struct batch *batch = Allocate(sizeof(struct batch));
+  batch->count = count;
+  batch->games = Allocate(count * sizeof(struct game));
+  batch->stats = Allocate(count * sizeof(struct sim_stats));
+  batch->loaded = Allocate(count * sizeof(struct alloc_counters));
+  batch->seed = seed;
+  batch->spawn_rate = rate;
+  batch->extra_monsters = extra_monsters;
+  for(int i = 0; i < count; i++)
+    {
+      struct sim_stats stats = {0, 0, 0, -1, 0, {0}, 0};
+      batch->stats[i] = stats;
+    }
+  
+  struct game *caller = game;
+  stepping = batch;
+  ParallelBatches(count, 1, StartGames);
+  game = caller;
+  return batch;
+}
+
+//Runs every game of 'batch' on for 'ticks' ticks.
+void StepBatch(struct batch *batch, long ticks)
+{
+  struct game *caller = game;
+  stepping = batch;
+  batch->ticks = ticks;
+  ParallelBatches(batch->count, 1, StepGames);
+  game = caller;
+}
+
+//Fills in the checksum and heap use of each game of 'batch' so far.
+void FinishBatch(struct batch *batch)
+{
+  struct game *caller = game;
+  for(int i = 0; i < batch->count; i++)
+    {
+      game = &batch->games[i];
+      batch->stats[i].checksum = WorldChecksum();
+      batch->stats[i].allocs = AllocsSince(batch->loaded[i]);
+    }
+  game = caller;
+}
+
+void FreeBatch(struct batch *batch)
+{
+  for(int i = 0; i < batch->count; i++)
+    { FreeGame(&batch->games[i]); }
+  Release(batch->games);
+  Release(batch->stats);
+  Release(batch->loaded);
+  Release(batch);
+}
+
+/*
+  Plays 'count' headless games of 'ticks' ticks as a batch, and prints
+  how each one went and how fast the batch ran. A game's checksum
+  should match the one from --headless with its seed.
+*/
+void RunBatch(int count, long ticks, int rate, unsigned int seed)
+{
+  double start = Now();
+  struct batch *batch = NewBatch(count, seed, rate, 0);
+  double loaded = Now();
+  StepBatch(batch, ticks);
+  double seconds = Now() - loaded;
+  FinishBatch(batch);
+  
+  long died = 0, refused = 0, heap_allocs = 0;
+  for(int i = 0; i < count; i++)
+    {
+      struct sim_stats *stats = &batch->stats[i];
+      printf("game %d: seed %u, peak %d entities, ", i, seed + i, stats->peak_entities);
+      if(stats->player_died_at >= 0)
+	{ printf("player died at tick %ld, ", stats->player_died_at); }
+      else
+	{ printf("player lived, "); }
+      printf("checksum %08x\n", stats->checksum);
+      died += (stats->player_died_at >= 0);
+      refused += stats->allocs.exhausted;
+      heap_allocs += stats->allocs.heap_allocs;
     }
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  printf("%d game%s of %ld ticks on %d thread%s and %ld CPU%s: loaded in %.3f s, played in %.3f s\n",
+	 count, count == 1 ? "" : "s", ticks, pool.workers, pool.workers == 1 ? "" : "s",
+	 cpus, cpus == 1 ? "" : "s", loaded - start, seconds);
+  printf("%.0f games/sec, %.0f ticks/sec in all; the player died in %ld\n",
+	 count / seconds, count * ticks / seconds, died);
+  printf("objects: %ld refused (pool full); heap: %ld allocations while ticking\n",
+	 refused, heap_allocs);
+  FreeBatch(batch);
+}
+
+void Usage(char *program)
+{
+  fprintf(stderr, "usage: %s [--map FILE] [--fps MAX] [--threads N] [--record FILE] [--trace FILE] [--frames DIR] [--golden FILE] [--audio SAMPLES]\n"
+	  "       [--headless TICKS SPAWN_RATE SEED | --batch GAMES TICKS SPAWN_RATE SEED | --render TICKS SPAWN_RATE SEED | --replay FILE | --replay-fast FILE | --bench | --bench-blit | --bench-sprites | --bench-render | --bench-collide | --bench-solid | --bench-flow | --bench-rewind]\n", program);
+  fprintf(stderr, "  MAX is the most frames to draw a second, or 0 for no limit\n");
+  fprintf(stderr, "  N is how many threads update the monsters, or 0 for one per CPU\n");
+  fprintf(stderr, "  SPAWN_RATE is extra monsters per tick, on top of the map's spawners\n");
+  fprintf(stderr, "  GAMES is how many games to play at once, seeded from SEED on\n");
+  fprintf(stderr, "  SAMPLES is how many samples the sound is mixed in at a time (256 by default), or 0 for no sound\n");
+  fprintf(stderr, "  --frames and --golden apply to --render: DIR gets its frames, and FILE is a PPM image its last should match\n");
+  exit(1);
 }
 
 int main(int argc, char *argv[])
 {
+  SelectKernels();
+  InitGame(&interactive_game, MAX_MONSTERS, TRUE);
+  
+  //Settings come ahead of anything else
+  int arg = 1;
+  for(; argc > arg + 1; arg += 2)
+    {
+      if(strcmp(argv[arg], "--map") == 0)
+	{ map_file = argv[arg + 1]; }
+      else if(strcmp(argv[arg], "--fps") == 0)
+	{ frame_rate_cap = atoi(argv[arg + 1]); }
+      else if(strcmp(argv[arg], "--threads") == 0)
+	{ worker_count = atoi(argv[arg + 1]); }
+      else if(strcmp(argv[arg], "--record") == 0)
+	{ record_file = argv[arg + 1]; }
+      else if(strcmp(argv[arg], "--trace") == 0)
+	{ trace_file = argv[arg + 1]; }
+      else if(strcmp(argv[arg], "--frames") == 0)
+	{ frames_dir = argv[arg + 1]; }
+      else if(strcmp(argv[arg], "--golden") == 0)
+	{ golden_file = argv[arg + 1]; }
+      else if(strcmp(argv[arg], "--audio") == 0)
+	{ audio_samples = atoi(argv[arg + 1]); }
+      else
+	{ break; }
+    }
+  StartWorkers();
+  
+  //Headless runs are only timed when traced, and batches not at all,
+  //since their games would all be timing the same phases at once
+  enum boolean batch = (argc - arg == 5 && strcmp(argv[arg], "--batch") == 0);
+  if (trace_file != NULL && !batch)
+    { StartProfiler(); }
+  atexit(ReportProfile);
+  atexit(WriteTrace);
+  
+  if(argc - arg == 4 && strcmp(argv[arg], "--headless") == 0)
+    {
+      PrintStats(RunHeadless(atol(argv[arg+1]), ParseSpawnRate(argv[arg+2]), strtoul(argv[arg+3], NULL, 10), 0));
+      return 0;
+    }
+  else if(batch)
+    {
+      RunBatch(atoi(argv[arg+1]), atol(argv[arg+2]), ParseSpawnRate(argv[arg+3]), strtoul(argv[arg+4], NULL, 10));
+      return 0;
+    }
+  else if(argc - arg == 4 && strcmp(argv[arg], "--render") == 0)
+    { return RunRender(atol(argv[arg+1]), ParseSpawnRate(argv[arg+2]), strtoul(argv[arg+3], NULL, 10)) ? 0 : 1; }
+  else if(argc - arg == 1 && strcmp(argv[arg], "--bench") == 0)
+    {
+      RunBenchmark();
+      return 0;
+    }
+  else if(argc - arg == 1 && strcmp(argv[arg], "--bench-blit") == 0)
+    {
+      RunBlitBenchmark();
+      return 0;
+    }
+  else if(argc - arg == 1 && strcmp(argv[arg], "--bench-sprites") == 0)
+    {
+      RunSpriteBenchmark();
+      return 0;
+    }
+  else if(argc - arg == 1 && strcmp(argv[arg], "--bench-render") == 0)
+    {
+      RunRenderBenchmark();
+      return 0;
+    }
+  else if(argc - arg == 1 && strcmp(argv[arg], "--bench-collide") == 0)
+    {
+      RunCollisionBenchmark(10000);
+      return 0;
+    }
+  else if(argc - arg == 1 && strcmp(argv[arg], "--bench-solid") == 0)
+    {
+      RunSolidBenchmark(10000);
+      return 0;
+    }
+  else if(argc - arg == 1 && strcmp(argv[arg], "--bench-flow") == 0)
+    {
+      RunFlowBenchmark();
+      return 0;
+    }
+  else if(argc - arg == 1 && strcmp(argv[arg], "--bench-rewind") == 0)
+    {
+      RunRewindBenchmark();
+      return 0;
+    }
+  else if(argc - arg == 2 && strcmp(argv[arg], "--replay-fast") == 0)
+    {
+      PrintStats(RunReplay(argv[arg+1]));
+      return 0;
+    }
+  else if(argc - arg == 2 && strcmp(argv[arg], "--replay") == 0)
+    { OpenReplay(argv[arg+1]); }
+  else if(argc != arg)
+    { Usage(argv[0]); }
+  
   initialize();
   
-  srand(time(NULL));
+  unsigned int seed = (game->replay->data != NULL) ? game->replay->seed : time(NULL);
+  game->seed = seed;
+  if (record_file != NULL)
+    { StartRecording(record_file, seed); }
     
   SDL_Surface *screen;
   screen = SDL_SetVideoMode(WIDTH, HEIGHT, DEPTH, SDL_SWSURFACE);
@@ -704,23 +6557,55 @@ int main(int argc, char *argv[])
       fprintf(stderr, "Unable to set 640x480 video: %s\n", SDL_GetError());
       exit(1);
     }
+  LoadAssets(screen);
+  OpenSound();
   
-  //Main game loop
+  /*
+    Main game loop. The game is updated on a thread of its own at a
+    fixed rate (see Simulate), while this one reads input and draws
+    the newest snapshot of the game, however far the clock has got
+    towards the next tick.
+  */
+  if (!game->profiler->on)
+    { StartProfiler(); }
+  
+  //(Reports are printed in the reverse of this order)
+  atexit(ReportSound);
+  atexit(ReportAssets);
+  atexit(ReportLatency);
+  atexit(ReportFrames);
+  atexit(FinishRecording);
+  StartSimulation();
+  atexit(StopSimulation);
+  double previous = Now();
   while(1)
     {
+      double started = ProfileStart();
+      HandleEvents();
+      Profile(PHASE_EVENTS, started);
+      
+      struct snapshot *snap = SnapshotToRead();
+      
       //Check for end game conditions
-      if (!player.alive)
+      if (__atomic_load_n(&game->replay->finished, __ATOMIC_ACQUIRE))
+	{
+	  StopSimulation();
+	  printf("replayed %ld ticks, final state checksum %08x\n", game->replay->tick, WorldChecksum());
+	  exit(0);
+	}
+      else if (!snap->player_alive)
 	{ RenderFinal(screen, FALSE); }
-      else if (g_monsters == NULL)
+      else if (!snap->monsters_left)
 	{ RenderFinal(screen, TRUE); }
-	
-      UpdateState();
-
-      RenderState(screen);
       
-      HandleEvents();
+      double now = Now();
+      RecordFrame(now - previous);
+      previous = now;
       
-      usleep(50000);
+      float alpha = (now - snap->time) / TICK_SECONDS;
+      RenderState(screen, snap, alpha < 0 ? 0 : alpha > 1 ? 1 : alpha);
+      
+      if (frame_rate_cap > 0)
+	{ SleepUntil(now + 1.0 / frame_rate_cap); }
     }
 }
-